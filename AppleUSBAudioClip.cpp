@@ -28,6 +28,11 @@
 class IOMemoryDescriptor;
 
 #include <IOKit/audio/IOAudioTypes.h>
+#include <libkern/OSAtomic.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
  
 #include "AppleUSBAudioClip.h"
 #include "AppleUSBAudioCommon.h"
@@ -62,6 +67,12 @@ static inline SInt32	SInt32NativeToLittleEndian(SInt32 inValue) { return inValue
 #define	kMaxClipSInt32		0.9999999995343387		// <rdar://7138492>
 #define kFloat32ToSInt32	((Float64)0x80000000)
 
+const float kOneOverMaxSInt8Value = 1.0/128.0f;
+const float kOneOverMaxSInt16Value = 1.0/32768.0f;
+// const float kOneOverMaxSInt24Value = 1.0/8388608.0f;
+const float kOneOverMaxSInt24Value = 0.00000011920928955078125f;
+const float kOneOverMaxSInt32Value = 1.0/2147483648.0f;
+
 inline static Float32 ClipFloat32ForSInt8(Float32 inSample)
 {
 	// Float32 maxClip = kMaxSampleSInt8 / (kMaxSampleSInt8 + 1.0);
@@ -95,6 +106,153 @@ inline static Float64 ClipFloat32ForSInt32(Float64 inSample)	// <rdar://7138492>
 	return inSample;
 }
 
+#pragma mark -Dither-
+
+//	Returns a TPDF dither value in (-1.0, 1.0) LSB: the difference of the two 16 bit halves of one xorshift32 draw.
+static inline Float32 NextTPDFDither (UInt32 * seed)
+{
+	UInt32	r = *seed;
+
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	*seed = r;
+	return (Float32)((SInt32)(r & 0x0000FFFF) - (SInt32)(r >> 16)) * (1.0f / 65536.0f);
+}
+
+//	Quantizes one sample to inBitDepth bits with TPDF dither and, if inError isn't NULL, first order error feedback.
+//	Returns the result left justified in 32 bits.
+static inline SInt32 DitherSample (Float32 inSample, Float32 inScale, UInt32 inBitDepth, UInt32 * ioSeed, Float32 * ioError)
+{
+	Float32		theTarget;
+	Float64		theDithered;
+	SInt32		theQuantized;
+	Float32		theError;
+
+	if (inSample != inSample)					// NaN
+	{
+		inSample = 0.0f;
+	}
+	if (inSample > 1.0f)
+	{
+		inSample = 1.0f;
+	}
+	if (inSample < -1.0f)
+	{
+		inSample = -1.0f;
+	}
+	theTarget = inSample * inScale;
+	if (ioError)
+	{
+		theTarget -= *ioError;
+	}
+
+	// Round to nearest, then clip to the integer range of inBitDepth.
+	theDithered = (Float64)theTarget + (Float64)NextTPDFDither (ioSeed) + 0.5;
+	theQuantized = (SInt32)theDithered;
+	if (theDithered < (Float64)theQuantized)
+	{
+		theQuantized--;
+	}
+	if (theQuantized > (SInt32)inScale - 1)
+	{
+		theQuantized = (SInt32)inScale - 1;
+	}
+	if (theQuantized < -(SInt32)inScale)
+	{
+		theQuantized = -(SInt32)inScale;
+	}
+
+	if (ioError)
+	{
+		// Limit the fed back error so that a clipped sample can't drive the shaper unstable.
+		theError = (Float32)theQuantized - theTarget;
+		if (theError > 1.0f)
+		{
+			theError = 1.0f;
+		}
+		if (theError < -1.0f)
+		{
+			theError = -1.0f;
+		}
+		*ioError = theError;
+	}
+
+	return (SInt32)((UInt32)theQuantized << (32 - inBitDepth));
+}
+
+//	Stores a left justified sample in a little endian container of inBitWidth bits (8, 16, 24 or 32).
+static inline UInt8 * StoreSampleLE (SInt32 inSample, UInt32 inBitWidth, UInt8 * outOutputBuffer)
+{
+	UInt32	theBytes = inBitWidth / 8;
+
+	for (UInt32 byte = 0; byte < theBytes; byte++)
+	{
+		*(outOutputBuffer++) = (UInt8)(((UInt32)inSample) >> (32 - inBitWidth + 8 * byte));
+	}
+	return outOutputBuffer;
+}
+
+//	Float32 -> dithered SInt8/16/24/32. inNumberSamples covers whole frames starting with channel 0.
+static void ClipFloat32ToDitheredLE (const Float32* inInputBuffer, UInt8* outOutputBuffer, UInt32 inNumberSamples, UInt32 inNumChannels,
+										UInt32 inBitWidth, UInt32 inBitDepth, ClipDitherState * ioState)
+{
+	const Float32	theScale = (Float32)(1 << (inBitDepth - 1));
+	bool			theShape = (kClipDitherTPDFShaped == ioState->mode) && (inNumChannels <= kClipDitherMaxChannels);
+	UInt32			theChannel = 0;
+
+	while (inNumberSamples-- > 0)
+	{
+		SInt32 theSample = DitherSample (*(inInputBuffer++), theScale, inBitDepth, &ioState->seed[0], theShape ? &ioState->error[theChannel] : NULL);
+
+		outOutputBuffer = StoreSampleLE (theSample, inBitWidth, outOutputBuffer);
+		if (++theChannel == inNumChannels)
+		{
+			theChannel = 0;
+		}
+	}
+}
+
+typedef void (*DitherRoutine)(const Float32* inInputBuffer, UInt8* outOutputBuffer, UInt32 inNumberSamples, UInt32 inNumChannels,
+								UInt32 inBitWidth, UInt32 inBitDepth, ClipDitherState * ioState);
+
+static DitherRoutine	sDitherRoutine = ClipFloat32ToDitheredLE;
+
+#pragma mark -Metering-
+
+//	Adds the level of inNumberFrames interleaved frames to the per channel accumulators. NaNs are skipped.
+static void MeterFloat32 (const Float32* inInputBuffer, UInt32 inNumberFrames, UInt32 inNumChannels, Float32 inClipThreshold,
+							Float32 * ioPeak, Float64 * ioSumOfSquares, UInt32 * ioClipCount)
+{
+	while (inNumberFrames-- > 0)
+	{
+		for (UInt32 channel = 0; channel < inNumChannels; channel++)
+		{
+			Float32	theSample = *(inInputBuffer++);
+			Float32	theLevel = (theSample < 0.0f) ? -theSample : theSample;
+
+			if (theSample != theSample)
+			{
+				continue;
+			}
+			if (theLevel > ioPeak[channel])
+			{
+				ioPeak[channel] = theLevel;
+			}
+			ioSumOfSquares[channel] += (Float64)(theSample * theSample);
+			if (theLevel >= inClipThreshold)
+			{
+				ioClipCount[channel]++;
+			}
+		}
+	}
+}
+
+typedef void (*MeterRoutine)(const Float32* inInputBuffer, UInt32 inNumberFrames, UInt32 inNumChannels, Float32 inClipThreshold,
+								Float32 * ioPeak, Float64 * ioSumOfSquares, UInt32 * ioClipCount);
+
+static MeterRoutine		sMeterRoutine = MeterFloat32;
+
 //	Float32 -> SInt8
 #if defined(__i386__) || defined(__x86_64__)
 static void	ClipFloat32ToSInt8_4(const Float32* inInputBuffer, SInt8* outOutputBuffer, UInt32 inNumberSamples)
@@ -312,176 +470,2588 @@ static void	ClipFloat32ToSInt32LE_4(const Float32* inInputBuffer, SInt32* outOut
 		--inNumberSamples;
 	}
 }
-#endif
 
-IOReturn clipAudioToOutputStream(const void* mixBuf, void* sampleBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat)
+
+//	SInt8 -> Float32
+static void	ConvertSInt8ToFloat32(const SInt8* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
 {
-    if(!streamFormat)
-	{
-        return kIOReturnBadArgument;
-    }
-	
-	UInt32		theNumberSamples	= numSampleFrames * streamFormat->fNumChannels;
-	UInt32		theFirstSample		= firstSampleFrame * streamFormat->fNumChannels;
-	Float32*	theMixBuffer		= ((Float32*)mixBuf) + theFirstSample;
+	while (inNumberSamples-- > 0) 
+	{	
+		*(outOutputBuffer++) = (float)(*(inInputBuffer++)) * kOneOverMaxSInt8Value;
+	}
+}
 
-	// aml, added optimized routines [3034710]
-	switch(streamFormat->fBitWidth)
+//	SInt16 -> Float32
+static void	ConvertSInt16LEToFloat32(const SInt16* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0) 
+	{	
+		*(outOutputBuffer++) = (float)(*(inInputBuffer++)) * kOneOverMaxSInt16Value;
+	}
+}
+
+//	SInt24 -> Float32
+static void	ConvertSInt24LEToFloat32(const UInt8* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	register SInt32 inputSample;
+
+	if (0 == inNumberSamples)
 	{
-		case 8:
-			{
-				SInt8* theOutputBufferSInt8 = ((SInt8*)sampleBuf) + theFirstSample;
-				#if	defined(__ppc__)
-					Float32ToInt8(theMixBuffer, theOutputBufferSInt8, theNumberSamples);
-				#elif defined (__i386__) || defined(__x86_64__)
-					ClipFloat32ToSInt8_4(theMixBuffer, theOutputBufferSInt8, theNumberSamples);
-				#endif	
-				//ClipFloat32ToSInt8_4(theMixBuffer, theOutputBufferSInt8, theNumberSamples);
-			}
-			break;
+		return;
+	}
 
-		case 16:
-			{
-				SInt16* theOutputBufferSInt16 = ((SInt16*)sampleBuf) + theFirstSample;
+	// [rdar://4311684] - Fixed 24-bit input convert routine. /thw
+	while (inNumberSamples-- > 1) 
+	{	
+		inputSample = (* (UInt32 *)inInputBuffer) & 0x00FFFFFF;
+		// Sign extend if necessary
+		if (inputSample > 0x7FFFFF)
+		{
+			inputSample |= 0xFF000000;
+		}
+		inInputBuffer += 3;
+		*(outOutputBuffer++) = (float)inputSample * kOneOverMaxSInt24Value;
+	}
+	// Convert last sample. The following line does the same work as above without going over the edge of the buffer.
+	inputSample = SInt32 ((UInt32 (*(UInt16 *) inInputBuffer) & 0x0000FFFF) | (SInt32 (*(SInt8 *)(inInputBuffer + 2)) << 16));
+	*(outOutputBuffer++) = (float)inputSample * kOneOverMaxSInt24Value;
+}
 
-				#if	defined(__ppc__)
-					Float32ToSwapInt16(theMixBuffer, theOutputBufferSInt16, theNumberSamples);
-				#elif defined(__i386__) || defined(__x86_64__)
-					ClipFloat32ToSInt16LE_4(theMixBuffer, theOutputBufferSInt16, theNumberSamples);
-				#endif	
-				//ClipFloat32ToSInt16LE_4(theMixBuffer, theOutputBufferSInt16, theNumberSamples);
-			}
-			break;
+//	SInt32 -> Float32
+static void	ConvertSInt32LEToFloat32(const SInt32* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0) 
+	{	
+		*(outOutputBuffer++) = (float)(*(inInputBuffer++)) * kOneOverMaxSInt32Value;
+	}
+}
 
-		case 20:
-		case 24:
-			{
-				SInt32* theOutputBufferSInt24 = (SInt32*)(((UInt8*)sampleBuf) + (theFirstSample * 3));
+#pragma mark -Integer clipping routines-
 
-				#if	defined(__ppc__)
-					Float32ToSwapInt24(theMixBuffer, theOutputBufferSInt24, theNumberSamples);
-				#elif defined(__i386__) || defined(__x86_64__)
-					ClipFloat32ToSInt24LE_4(theMixBuffer, theOutputBufferSInt24, theNumberSamples);
-				#endif	
-				//ClipFloat32ToSInt24LE_4(theMixBuffer, theOutputBufferSInt24, theNumberSamples);
-			}
-			break;
+//	These routines work on the IEEE754 bits of the samples with integer operations only, so that a platform where using
+//	the FPU or the vector unit in the kernel means saving and restoring its state on every engine callback can avoid it.
+//	They produce the same bits as the scalar Float32 routines above, which truncate toward zero after clipping.
+typedef UInt32 __attribute__((__may_alias__))	Float32Bits;
 
-		case 32:
-			{
-				SInt32* theOutputBufferSInt32 = ((SInt32*)sampleBuf) + theFirstSample;
+//	Returns the Float32 in inBits times 2^inShift, truncated toward zero and clipped to [-2^inShift, 2^inShift - 1].
+//	NaN gives 0x80000000, which is what the conversion instructions the scalar routines compile to return.
+static inline SInt32 ClipFloat32BitsToSInt (UInt32 inBits, UInt32 inShift)
+{
+	UInt32	theExponent = (inBits >> 23) & 0xFF;
+	UInt32	theMagnitude;
+	SInt32	theScale;
 
-				#if	defined(__ppc__)
-					Float32ToSwapInt32(theMixBuffer, theOutputBufferSInt32, theNumberSamples);
-				#elif defined(__i386__) || defined(__x86_64__)
-					ClipFloat32ToSInt32LE_4(theMixBuffer, theOutputBufferSInt32, theNumberSamples);
-				#endif	
-				//ClipFloat32ToSInt32LE_4(theMixBuffer, theOutputBufferSInt32, theNumberSamples);
-			}
-			break;
-	};
-		
-	return kIOReturnSuccess;
+	if (theExponent >= 127)											// |x| >= 1.0, infinities and NaN
+	{
+		if ((inBits & 0x7FFFFFFF) > 0x7F800000)
+		{
+			return (SInt32)0x80000000;
+		}
+		return (inBits & 0x80000000) ? (SInt32)(0u - (1u << inShift)) : (SInt32)((1u << inShift) - 1);
+	}
+	if (theExponent < 127 - inShift)								// |x| * 2^inShift < 1.0, including denormals
+	{
+		return 0;
+	}
+
+	// |x| * 2^inShift = mantissa * 2^(exponent - 150 + inShift)
+	theMagnitude = (inBits & 0x007FFFFF) | 0x00800000;
+	theScale = (SInt32)(theExponent + inShift) - 150;
+	theMagnitude = (theScale >= 0) ? (theMagnitude << theScale) : (theMagnitude >> -theScale);
+
+	return (inBits & 0x80000000) ? (SInt32)(0u - theMagnitude) : (SInt32)theMagnitude;
 }
-	
-const float kOneOverMaxSInt8Value = 1.0/128.0f;
-const float kOneOverMaxSInt16Value = 1.0/32768.0f;
-// const float kOneOverMaxSInt24Value = 1.0/8388608.0f;
-const float kOneOverMaxSInt24Value = 0.00000011920928955078125f;
-const float kOneOverMaxSInt32Value = 1.0/2147483648.0f;
 
-IOReturn convertFromAudioInputStream_NoWrap (const void *sampleBuf,
-												void *destBuf,
-												UInt32 firstSampleFrame,
-												UInt32 numSampleFrames,
-												const IOAudioStreamFormat *streamFormat) {
-	UInt32	numSamplesLeft;
-	float 	*floatDestBuf;
+//	Returns the bits of the Float32 nearest to inValue / 2^inShift, rounding ties to even like (Float32)inValue does.
+static inline UInt32 SIntToFloat32Bits (SInt32 inValue, UInt32 inShift)
+{
+	UInt32	theSign = (inValue < 0) ? 0x80000000 : 0;
+	UInt32	theMagnitude = theSign ? (0u - (UInt32)inValue) : (UInt32)inValue;
+	UInt32	theTopBit;
+	UInt32	theExponent;
 
-    floatDestBuf = (float *)destBuf;
-	numSamplesLeft = numSampleFrames * streamFormat->fNumChannels;
+	if (0 == theMagnitude)
+	{
+		return 0;
+	}
 
-	//	debugIOLog ("destBuf = %p, firstSampleFrame = %ld, numSampleFrames = %ld", destBuf, firstSampleFrame, numSampleFrames);
+	theTopBit = 31 - __builtin_clz (theMagnitude);
+	theExponent = theTopBit + 127 - inShift;
+	if (theTopBit > 23)												// only SInt32 samples have more bits than the mantissa
+	{
+		UInt32	theDropped = theTopBit - 23;
+		UInt32	theRest = theMagnitude & ((1u << theDropped) - 1);
+		UInt32	theHalf = 1u << (theDropped - 1);
 
-	switch (streamFormat->fBitWidth) 
+		theMagnitude >>= theDropped;
+		if ((theRest > theHalf) || ((theRest == theHalf) && (theMagnitude & 1)))
+		{
+			theMagnitude++;
+			if (theMagnitude == (1u << 24))
+			{
+				theMagnitude >>= 1;
+				theExponent++;
+			}
+		}
+	}
+	else
 	{
-		case 8:
-			SInt8 *inputBuf8;
+		theMagnitude <<= (23 - theTopBit);
+	}
 
-			inputBuf8 = &(((SInt8 *)sampleBuf)[firstSampleFrame * streamFormat->fNumChannels]);
-			#if defined(__ppc__)
-				Int8ToFloat32(inputBuf8, floatDestBuf, numSamplesLeft);
-			#elif defined(__i386__) || defined(__x86_64__)
-				while (numSamplesLeft-- > 0) 
-				{	
-					*(floatDestBuf++) = (float)(*(inputBuf8++)) * kOneOverMaxSInt8Value;
-				}
-			#endif
+	return theSign | (theExponent << 23) | (theMagnitude & 0x007FFFFF);
+}
 
-			break;
-		case 16:
-			SInt16 *inputBuf16;
-			
-			inputBuf16 = &(((SInt16 *)sampleBuf)[firstSampleFrame * streamFormat->fNumChannels]);
+static void	ClipFloat32ToSInt8_Int(const Float32Bits* inInputBuffer, SInt8* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0)
+	{
+		*(outOutputBuffer++) = (SInt8)ClipFloat32BitsToSInt (*(inInputBuffer++), 7);
+	}
+}
 
-			#if defined(__ppc__)
-				SwapInt16ToFloat32(inputBuf16, floatDestBuf, numSamplesLeft, 16);
-			#elif defined(__i386__) || defined(__x86_64__)
-				while (numSamplesLeft-- > 0) 
-				{	
-					*(floatDestBuf++) = (float)(*(inputBuf16++)) * kOneOverMaxSInt16Value;
-				}
-			#endif
+static void	ClipFloat32ToSInt16LE_Int(const Float32Bits* inInputBuffer, SInt16* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0)
+	{
+		*(outOutputBuffer++) = SInt16NativeToLittleEndian((SInt16)ClipFloat32BitsToSInt (*(inInputBuffer++), 15));
+	}
+}
 
-			break;
-		case 20:
-		case 24:
-			register SInt8 *inputBuf24;
+//	Clipped at 32 bits and then truncated to the top three bytes, like ClipFloat32ToSInt24LE_4.
+static void	ClipFloat32ToSInt24LE_Int(const Float32Bits* inInputBuffer, UInt8* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0)
+	{
+		UInt32	theValue = (UInt32)ClipFloat32BitsToSInt (*(inInputBuffer++), 31);
 
-			// Multiply by 3 because 20 and 24 bit samples are packed into only three bytes, so we have to index bytes, not shorts or longs
-			inputBuf24 = &(((SInt8 *)sampleBuf)[firstSampleFrame * streamFormat->fNumChannels * 3]);
+		*(outOutputBuffer + 0) = (UInt8)(theValue >> 8);
+		*(outOutputBuffer + 1) = (UInt8)(theValue >> 16);
+		*(outOutputBuffer + 2) = (UInt8)(theValue >> 24);
+		outOutputBuffer += 3;
+	}
+}
 
-			#if defined(__ppc__)
-				SwapInt24ToFloat32((long *)inputBuf24, floatDestBuf, numSamplesLeft, 24);
-			#elif defined(__i386__) || defined(__x86_64__)
-				register SInt32 inputSample;
-				
-				// [rdar://4311684] - Fixed 24-bit input convert routine. /thw
-				while (numSamplesLeft-- > 1) 
-				{	
-					inputSample = (* (UInt32 *)inputBuf24) & 0x00FFFFFF;
-					// Sign extend if necessary
-					if (inputSample > 0x7FFFFF)
-					{
-						inputSample |= 0xFF000000;
-					}
-					inputBuf24 += 3;
-					*(floatDestBuf++) = (float)inputSample * kOneOverMaxSInt24Value;
-				}
-				// Convert last sample. The following line does the same work as above without going over the edge of the buffer.
-				inputSample = SInt32 ((UInt32 (*(UInt16 *) inputBuf24) & 0x0000FFFF) | (SInt32 (*(inputBuf24 + 2)) << 16));
-				*(floatDestBuf++) = (float)inputSample * kOneOverMaxSInt24Value;
-			#endif
+static void	ClipFloat32ToSInt32LE_Int(const Float32Bits* inInputBuffer, SInt32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0)
+	{
+		*(outOutputBuffer++) = SInt32NativeToLittleEndian(ClipFloat32BitsToSInt (*(inInputBuffer++), 31));
+	}
+}
 
-			break;
-		case 32:
-			register SInt32 *inputBuf32;
-			inputBuf32 = &(((SInt32 *)sampleBuf)[firstSampleFrame * streamFormat->fNumChannels]);
+static void	ConvertSInt8ToFloat32_Int(const SInt8* inInputBuffer, Float32Bits* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0)
+	{
+		*(outOutputBuffer++) = SIntToFloat32Bits (*(inInputBuffer++), 7);
+	}
+}
 
-			#if defined(__ppc__)
-				SwapInt32ToFloat32(inputBuf32, floatDestBuf, numSamplesLeft, 32);
-			#elif defined(__i386__) || defined(__x86_64__)
-				while (numSamplesLeft-- > 0) {	
-					*(floatDestBuf++) = (float)(*(inputBuf32++)) * kOneOverMaxSInt32Value;
-				}
-			#endif
+static void	ConvertSInt16LEToFloat32_Int(const SInt16* inInputBuffer, Float32Bits* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0)
+	{
+		*(outOutputBuffer++) = SIntToFloat32Bits (*(inInputBuffer++), 15);
+	}
+}
 
-			break;
+static void	ConvertSInt24LEToFloat32_Int(const UInt8* inInputBuffer, Float32Bits* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0)
+	{
+		SInt32	theValue = (SInt32)(((UInt32)inInputBuffer[0] << 8) | ((UInt32)inInputBuffer[1] << 16) | ((UInt32)inInputBuffer[2] << 24)) >> 8;
+
+		*(outOutputBuffer++) = SIntToFloat32Bits (theValue, 23);
+		inInputBuffer += 3;
+	}
+}
+
+static void	ConvertSInt32LEToFloat32_Int(const SInt32* inInputBuffer, Float32Bits* outOutputBuffer, UInt32 inNumberSamples)
+{
+	while (inNumberSamples-- > 0)
+	{
+		*(outOutputBuffer++) = SIntToFloat32Bits (*(inInputBuffer++), 31);
+	}
+}
+
+#pragma mark -Vectorized clipping routines-
+
+//	The vectorized routines are compiled for their instruction set with a target attribute and are only ever
+//	called after CPUFeatures () has confirmed that the processor (and, for AVX, the OS) supports them.
+#define CLIP_TARGET( features )		__attribute__((target(features)))
+
+enum
+{
+	kCPUFeatureSSE2					= (1 << 0),
+	kCPUFeatureSSSE3				= (1 << 1),
+	kCPUFeatureAVX2					= (1 << 2),
+	kCPUFeatureAVX512				= (1 << 3),
+	kCPUFeaturesValid				= 0x80000000
+};
+
+static inline void CPUID (UInt32 leaf, UInt32 subleaf, UInt32 * regs)
+{
+	__asm__ __volatile__ ("cpuid" : "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]), "=d" (regs[3]) : "a" (leaf), "c" (subleaf));
+}
+
+static inline UInt64 XGETBV (UInt32 index)
+{
+	UInt32 lo, hi;
+	__asm__ __volatile__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (index));
+	return ((UInt64)hi << 32) | lo;
+}
+
+static UInt32 CPUFeatures (void)
+{
+	static volatile UInt32	sFeatures = 0;
+	UInt32					features = sFeatures;
+	UInt32					regs[4];
+	UInt32					maxLeaf;
+
+	if (0 == (features & kCPUFeaturesValid))
+	{
+		features = kCPUFeaturesValid;
+		CPUID (0, 0, regs);
+		maxLeaf = regs[0];
+		CPUID (1, 0, regs);
+		if (regs[3] & (1 << 26))
+		{
+			features |= kCPUFeatureSSE2;
+		}
+		if (regs[2] & (1 << 9))
+		{
+			features |= kCPUFeatureSSSE3;
+		}
+		// AVX2 needs OSXSAVE and the OS must be preserving the XMM and YMM state (XCR0 bits 1 and 2).
+		if (		(maxLeaf >= 7)
+				&&	(regs[2] & (1 << 27))
+				&&	(0x6 == (XGETBV (0) & 0x6)))
+		{
+			CPUID (7, 0, regs);
+			if (regs[1] & (1 << 5))
+			{
+				features |= kCPUFeatureAVX2;
+			}
+			// AVX-512 F and BW, with the opmask and ZMM state (XCR0 bits 5 to 7) enabled as well.
+			if (		((regs[1] & (1 << 16)) && (regs[1] & (1 << 30)))
+					&&	(0xE6 == (XGETBV (0) & 0xE6)))
+			{
+				features |= kCPUFeatureAVX512;
+			}
+		}
+		sFeatures = features;
+	}
+	return features;
+}
+
+//	Float32 -> SInt24, 16 samples per iteration.
+//	Matches ClipFloat32ToSInt24LE_4 bit for bit: the clamp, the scale by 2^31 and the truncation are all exact in single
+//	precision, and NaN survives the clamp (min/max return their second operand for NaN) so that it truncates to 0x80000000
+//	just like the scalar (SInt32) cast. The low byte of each 32 bit lane is then dropped with a byte shuffle and the four
+//	12 byte groups are stitched into three 16 byte stores.
+CLIP_TARGET("ssse3") static void ClipFloat32ToSInt24LE_SSSE3(const Float32* inInputBuffer, SInt32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theMaxClip		= _mm_set1_ps((Float32)kMaxClipSInt24);
+	const __m128	theMinClip		= _mm_set1_ps(-1.0f);
+	const __m128	theScale		= _mm_set1_ps((Float32)kFloat32ToSInt32);
+	const __m128i	thePackMask		= _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+	UInt8 *			theOutputBuffer	= (UInt8 *)outOutputBuffer;
+
+	while(inNumberSamples >= 16)
+	{
+		__m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 0))), theScale));
+		__m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 4))), theScale));
+		__m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 8))), theScale));
+		__m128i d = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 12))), theScale));
+
+		inInputBuffer += 16;
+
+		a = _mm_shuffle_epi8(a, thePackMask);
+		b = _mm_shuffle_epi8(b, thePackMask);
+		c = _mm_shuffle_epi8(c, thePackMask);
+		d = _mm_shuffle_epi8(d, thePackMask);
+
+		_mm_storeu_si128((__m128i *)(theOutputBuffer + 0), _mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_storeu_si128((__m128i *)(theOutputBuffer + 16), _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_storeu_si128((__m128i *)(theOutputBuffer + 32), _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+
+		theOutputBuffer += 48;
+		inNumberSamples -= 16;
+	}
+
+	ClipFloat32ToSInt24LE_4(inInputBuffer, (SInt32*)theOutputBuffer, inNumberSamples);
+}
+
+//	Float32 -> SInt24, 32 samples per iteration.
+//	Same arithmetic as the SSSE3 routine on eight lanes. The in-lane byte shuffle leaves six valid dwords per register
+//	(0, 1, 2, 4, 5, 6), so a cross-lane dword permute plus a blend assembles each 32 byte store from two registers.
+CLIP_TARGET("avx2") static void ClipFloat32ToSInt24LE_AVX2(const Float32* inInputBuffer, SInt32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m256	theMaxClip		= _mm256_set1_ps((Float32)kMaxClipSInt24);
+	const __m256	theMinClip		= _mm256_set1_ps(-1.0f);
+	const __m256	theScale		= _mm256_set1_ps((Float32)kFloat32ToSInt32);
+	const __m256i	thePackMask		= _mm256_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1,
+														1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+	const __m256i	thePermuteA0	= _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 0, 0);
+	const __m256i	thePermuteB0	= _mm256_setr_epi32(0, 0, 0, 0, 0, 0, 0, 1);
+	const __m256i	thePermuteB1	= _mm256_setr_epi32(2, 4, 5, 6, 0, 0, 0, 0);
+	const __m256i	thePermuteC1	= _mm256_setr_epi32(0, 0, 0, 0, 0, 1, 2, 4);
+	const __m256i	thePermuteC2	= _mm256_setr_epi32(5, 6, 0, 0, 0, 0, 0, 0);
+	const __m256i	thePermuteD2	= _mm256_setr_epi32(0, 0, 0, 1, 2, 4, 5, 6);
+	UInt8 *			theOutputBuffer	= (UInt8 *)outOutputBuffer;
+
+	while(inNumberSamples >= 32)
+	{
+		__m256i a = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_max_ps(theMinClip, _mm256_min_ps(theMaxClip, _mm256_loadu_ps(inInputBuffer + 0))), theScale));
+		__m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_max_ps(theMinClip, _mm256_min_ps(theMaxClip, _mm256_loadu_ps(inInputBuffer + 8))), theScale));
+		__m256i c = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_max_ps(theMinClip, _mm256_min_ps(theMaxClip, _mm256_loadu_ps(inInputBuffer + 16))), theScale));
+		__m256i d = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_max_ps(theMinClip, _mm256_min_ps(theMaxClip, _mm256_loadu_ps(inInputBuffer + 24))), theScale));
+
+		inInputBuffer += 32;
+
+		a = _mm256_shuffle_epi8(a, thePackMask);
+		b = _mm256_shuffle_epi8(b, thePackMask);
+		c = _mm256_shuffle_epi8(c, thePackMask);
+		d = _mm256_shuffle_epi8(d, thePackMask);
+
+		_mm256_storeu_si256((__m256i *)(theOutputBuffer + 0), _mm256_blend_epi32(_mm256_permutevar8x32_epi32(a, thePermuteA0), _mm256_permutevar8x32_epi32(b, thePermuteB0), 0xC0));
+		_mm256_storeu_si256((__m256i *)(theOutputBuffer + 32), _mm256_blend_epi32(_mm256_permutevar8x32_epi32(b, thePermuteB1), _mm256_permutevar8x32_epi32(c, thePermuteC1), 0xF0));
+		_mm256_storeu_si256((__m256i *)(theOutputBuffer + 64), _mm256_blend_epi32(_mm256_permutevar8x32_epi32(c, thePermuteC2), _mm256_permutevar8x32_epi32(d, thePermuteD2), 0xFC));
+
+		theOutputBuffer += 96;
+		inNumberSamples -= 32;
+	}
+
+	ClipFloat32ToSInt24LE_SSSE3(inInputBuffer, (SInt32*)theOutputBuffer, inNumberSamples);
+}
+
+//	Float32 -> SInt8, 16 samples per iteration.
+//	The scalar (SInt8) cast keeps the low byte of the truncated value (NaN truncates to 0x80000000 and so becomes 0), so
+//	the lanes are sign extended from their low byte before the saturating packs, which then cannot saturate.
+CLIP_TARGET("sse2") static void ClipFloat32ToSInt8_SSE2(const Float32* inInputBuffer, SInt8* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theMaxClip		= _mm_set1_ps((Float32)kMaxClipSInt8);
+	const __m128	theMinClip		= _mm_set1_ps(-1.0f);
+	const __m128	theScale		= _mm_set1_ps(kFloat32ToSInt8);
+
+	while(inNumberSamples >= 16)
+	{
+		__m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 0))), theScale));
+		__m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 4))), theScale));
+		__m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 8))), theScale));
+		__m128i d = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 12))), theScale));
+
+		inInputBuffer += 16;
+
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 24), 24);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 24), 24);
+		c = _mm_srai_epi32(_mm_slli_epi32(c, 24), 24);
+		d = _mm_srai_epi32(_mm_slli_epi32(d, 24), 24);
+
+		_mm_storeu_si128((__m128i *)outOutputBuffer, _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+
+		outOutputBuffer += 16;
+		inNumberSamples -= 16;
+	}
+
+	ClipFloat32ToSInt8_4(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	Float32 -> SInt16, 16 samples per iteration.
+//	As above, the lanes are sign extended from their low 16 bits to reproduce the scalar (SInt16) cast.
+CLIP_TARGET("sse2") static void ClipFloat32ToSInt16LE_SSE2(const Float32* inInputBuffer, SInt16* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theMaxClip		= _mm_set1_ps((Float32)kMaxClipSInt16);
+	const __m128	theMinClip		= _mm_set1_ps(-1.0f);
+	const __m128	theScale		= _mm_set1_ps(kFloat32ToSInt16);
+
+	while(inNumberSamples >= 16)
+	{
+		__m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 0))), theScale));
+		__m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 4))), theScale));
+		__m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 8))), theScale));
+		__m128i d = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 12))), theScale));
+
+		inInputBuffer += 16;
+
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		c = _mm_srai_epi32(_mm_slli_epi32(c, 16), 16);
+		d = _mm_srai_epi32(_mm_slli_epi32(d, 16), 16);
+
+		_mm_storeu_si128((__m128i *)(outOutputBuffer + 0), _mm_packs_epi32(a, b));
+		_mm_storeu_si128((__m128i *)(outOutputBuffer + 8), _mm_packs_epi32(c, d));
+
+		outOutputBuffer += 16;
+		inNumberSamples -= 16;
+	}
+
+	ClipFloat32ToSInt16LE_4(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	Float32 -> SInt32, 8 samples per iteration.
+//	The scalar routine clips in double precision, where every float at or above 1.0 clips to kMaxClipSInt32 and every
+//	float below 1.0 passes. In single precision the scale by 2^31 is exact for [-1.0, 1.0), so only the upper clip needs
+//	to be patched in after the conversion. NaN fails the compare and converts to 0x80000000, as it does in the scalar code.
+CLIP_TARGET("sse2") static void ClipFloat32ToSInt32LE_SSE2(const Float32* inInputBuffer, SInt32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theMinClip		= _mm_set1_ps(-1.0f);
+	const __m128	theOne			= _mm_set1_ps(1.0f);
+	const __m128	theScale		= _mm_set1_ps((Float32)kFloat32ToSInt32);
+	const __m128i	theMaxValue		= _mm_set1_epi32((SInt32)(kMaxClipSInt32 * kFloat32ToSInt32));
+
+	while(inNumberSamples >= 8)
+	{
+		__m128	x0 = _mm_loadu_ps(inInputBuffer + 0);
+		__m128	x1 = _mm_loadu_ps(inInputBuffer + 4);
+		__m128i	clip0 = _mm_castps_si128(_mm_cmpge_ps(x0, theOne));
+		__m128i	clip1 = _mm_castps_si128(_mm_cmpge_ps(x1, theOne));
+		__m128i	a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, x0), theScale));
+		__m128i	b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, x1), theScale));
+
+		inInputBuffer += 8;
+
+		_mm_storeu_si128((__m128i *)(outOutputBuffer + 0), _mm_or_si128(_mm_andnot_si128(clip0, a), _mm_and_si128(clip0, theMaxValue)));
+		_mm_storeu_si128((__m128i *)(outOutputBuffer + 4), _mm_or_si128(_mm_andnot_si128(clip1, b), _mm_and_si128(clip1, theMaxValue)));
+
+		outOutputBuffer += 8;
+		inNumberSamples -= 8;
+	}
+
+	ClipFloat32ToSInt32LE_4(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	SInt8 -> Float32, 16 samples per iteration.
+//	Interleaving with zero moves each byte to the top of a 32 bit lane, and an arithmetic shift sign extends it.
+CLIP_TARGET("sse2") static void ConvertSInt8ToFloat32_SSE2(const SInt8* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theScale		= _mm_set1_ps(kOneOverMaxSInt8Value);
+	const __m128i	theZero			= _mm_setzero_si128();
+
+	while(inNumberSamples >= 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)inInputBuffer);
+		__m128i lo = _mm_unpacklo_epi8(theZero, x);
+		__m128i hi = _mm_unpackhi_epi8(theZero, x);
+
+		_mm_storeu_ps(outOutputBuffer + 0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(theZero, lo), 24)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(theZero, lo), 24)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(theZero, hi), 24)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(theZero, hi), 24)), theScale));
+
+		inInputBuffer += 16;
+		outOutputBuffer += 16;
+		inNumberSamples -= 16;
+	}
+
+	ConvertSInt8ToFloat32(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	SInt16 -> Float32, 16 samples per iteration.
+CLIP_TARGET("sse2") static void ConvertSInt16LEToFloat32_SSE2(const SInt16* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theScale		= _mm_set1_ps(kOneOverMaxSInt16Value);
+	const __m128i	theZero			= _mm_setzero_si128();
+
+	while(inNumberSamples >= 16)
+	{
+		__m128i x0 = _mm_loadu_si128((const __m128i *)(inInputBuffer + 0));
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(inInputBuffer + 8));
+
+		_mm_storeu_ps(outOutputBuffer + 0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(theZero, x0), 16)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(theZero, x0), 16)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(theZero, x1), 16)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(theZero, x1), 16)), theScale));
+
+		inInputBuffer += 16;
+		outOutputBuffer += 16;
+		inNumberSamples -= 16;
+	}
+
+	ConvertSInt16LEToFloat32(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	SInt32 -> Float32, 8 samples per iteration.
+//	cvtdq2ps rounds to nearest like the scalar conversion, and the scale by 2^-31 is exact.
+CLIP_TARGET("sse2") static void ConvertSInt32LEToFloat32_SSE2(const SInt32* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theScale		= _mm_set1_ps(kOneOverMaxSInt32Value);
+
+	while(inNumberSamples >= 8)
+	{
+		_mm_storeu_ps(outOutputBuffer + 0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(inInputBuffer + 0))), theScale));
+		_mm_storeu_ps(outOutputBuffer + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(inInputBuffer + 4))), theScale));
+
+		inInputBuffer += 8;
+		outOutputBuffer += 8;
+		inNumberSamples -= 8;
+	}
+
+	ConvertSInt32LEToFloat32(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	SInt24 -> Float32, 16 samples per iteration.
+//	Each group of four packed samples is shuffled into the top three bytes of four 32 bit lanes, and an arithmetic shift
+//	by 8 sign extends them. The integer to float conversion and the scale are exact, so the result is identical to the
+//	scalar routine. Every load stays inside the 48 bytes consumed by the iteration; the scalar routine handles the tail.
+CLIP_TARGET("ssse3") static void ConvertSInt24LEToFloat32_SSSE3(const UInt8* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theScale		= _mm_set1_ps(kOneOverMaxSInt24Value);
+	const __m128i	theUnpackMask	= _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	const __m128i	theUnpackMaskHi	= _mm_setr_epi8(-1, 4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15);
+
+	while(inNumberSamples >= 16)
+	{
+		__m128i x0 = _mm_loadu_si128((const __m128i *)(inInputBuffer + 0));
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(inInputBuffer + 16));
+		__m128i x2 = _mm_loadu_si128((const __m128i *)(inInputBuffer + 32));
+
+		__m128i a = _mm_shuffle_epi8(x0, theUnpackMask);
+		__m128i b = _mm_shuffle_epi8(_mm_alignr_epi8(x1, x0, 12), theUnpackMask);
+		__m128i c = _mm_shuffle_epi8(_mm_alignr_epi8(x2, x1, 8), theUnpackMask);
+		__m128i d = _mm_shuffle_epi8(x2, theUnpackMaskHi);
+
+		_mm_storeu_ps(outOutputBuffer + 0, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(a, 8)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(b, 8)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(c, 8)), theScale));
+		_mm_storeu_ps(outOutputBuffer + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(d, 8)), theScale));
+
+		inInputBuffer += 48;
+		outOutputBuffer += 16;
+		inNumberSamples -= 16;
+	}
+
+	ConvertSInt24LEToFloat32(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	SInt24 -> Float32, 16 samples per iteration on eight lanes.
+//	Each 128 bit half is loaded so that its four samples start at byte 0 (or byte 4 for the last group, to keep the
+//	load inside the 48 bytes consumed by the iteration) and the same in-lane shuffle as the SSSE3 routine is applied.
+CLIP_TARGET("avx2") static void ConvertSInt24LEToFloat32_AVX2(const UInt8* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m256	theScale		= _mm256_set1_ps(kOneOverMaxSInt24Value);
+	const __m256i	theUnpackMaskA	= _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+														-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	const __m256i	theUnpackMaskB	= _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+														-1, 4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15);
+
+	while(inNumberSamples >= 16)
+	{
+		__m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(inInputBuffer + 0))),
+											_mm_loadu_si128((const __m128i *)(inInputBuffer + 12)), 1);
+		__m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(inInputBuffer + 24))),
+											_mm_loadu_si128((const __m128i *)(inInputBuffer + 32)), 1);
+
+		a = _mm256_shuffle_epi8(a, theUnpackMaskA);
+		b = _mm256_shuffle_epi8(b, theUnpackMaskB);
+
+		_mm256_storeu_ps(outOutputBuffer + 0, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(a, 8)), theScale));
+		_mm256_storeu_ps(outOutputBuffer + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(b, 8)), theScale));
+
+		inInputBuffer += 48;
+		outOutputBuffer += 16;
+		inNumberSamples -= 16;
+	}
+
+	ConvertSInt24LEToFloat32(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	Float32 -> SInt24, 16 samples per iteration on sixteen lanes.
+//	After the in-lane byte shuffle a single dword permute gathers the twelve valid dwords, and a masked store writes
+//	exactly the 48 bytes that belong to the iteration.
+CLIP_TARGET("avx512f,avx512bw") static void ClipFloat32ToSInt24LE_AVX512(const Float32* inInputBuffer, SInt32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m512	theMaxClip		= _mm512_set1_ps((Float32)kMaxClipSInt24);
+	const __m512	theMinClip		= _mm512_set1_ps(-1.0f);
+	const __m512	theScale		= _mm512_set1_ps((Float32)kFloat32ToSInt32);
+	const __m512i	thePackMask		= _mm512_broadcast_i32x4(_mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1));
+	const __m512i	thePermute		= _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0, 0, 0, 0);
+	UInt8 *			theOutputBuffer	= (UInt8 *)outOutputBuffer;
+
+	while(inNumberSamples >= 16)
+	{
+		__m512i a = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_max_ps(theMinClip, _mm512_min_ps(theMaxClip, _mm512_loadu_ps(inInputBuffer))), theScale));
+
+		inInputBuffer += 16;
+
+		a = _mm512_permutexvar_epi32(thePermute, _mm512_shuffle_epi8(a, thePackMask));
+		_mm512_mask_storeu_epi32(theOutputBuffer, 0x0FFF, a);
+
+		theOutputBuffer += 48;
+		inNumberSamples -= 16;
+	}
+
+	ClipFloat32ToSInt24LE_SSSE3(inInputBuffer, (SInt32*)theOutputBuffer, inNumberSamples);
+}
+
+//	SInt24 -> Float32, 16 samples per iteration on sixteen lanes.
+//	A masked load reads exactly 48 bytes, a dword permute gives each 128 bit lane the 12 bytes of its four samples, and
+//	the same in-lane shuffle as the SSSE3 routine places them in the top three bytes of each 32 bit lane.
+CLIP_TARGET("avx512f,avx512bw") static void ConvertSInt24LEToFloat32_AVX512(const UInt8* inInputBuffer, Float32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m512	theScale		= _mm512_set1_ps(kOneOverMaxSInt24Value);
+	const __m512i	theUnpackMask	= _mm512_broadcast_i32x4(_mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11));
+	const __m512i	thePermute		= _mm512_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6, 6, 7, 8, 9, 9, 10, 11, 12);
+
+	while(inNumberSamples >= 16)
+	{
+		__m512i x = _mm512_maskz_loadu_epi32(0x0FFF, inInputBuffer);
+
+		x = _mm512_shuffle_epi8(_mm512_permutexvar_epi32(thePermute, x), theUnpackMask);
+		_mm512_storeu_ps(outOutputBuffer, _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srai_epi32(x, 8)), theScale));
+
+		inInputBuffer += 48;
+		outOutputBuffer += 16;
+		inNumberSamples -= 16;
+	}
+
+	ConvertSInt24LEToFloat32_SSSE3(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	One TPDF dither value in (-1.0, 1.0) LSB per lane, from a per lane xorshift32 generator.
+CLIP_TARGET("ssse3") static inline __m128 NextTPDFDither4 (__m128i * ioSeed)
+{
+	__m128i r = *ioSeed;
+
+	r = _mm_xor_si128(r, _mm_slli_epi32(r, 13));
+	r = _mm_xor_si128(r, _mm_srli_epi32(r, 17));
+	r = _mm_xor_si128(r, _mm_slli_epi32(r, 5));
+	*ioSeed = r;
+	return _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(_mm_and_si128(r, _mm_set1_epi32(0x0000FFFF))), _mm_cvtepi32_ps(_mm_srli_epi32(r, 16))), _mm_set1_ps(1.0f / 65536.0f));
+}
+
+//	Vector version of DitherSample () for four samples. inErrors and outErrors are NULL without noise shaping.
+//	At 24 bits a Float32 sample holds no more than half an LSB of fraction, so the dither is added to the exact
+//	residual of the nearest integer rather than to the sample, and rounded with floor (x + 0.5) like the scalar step.
+CLIP_TARGET("ssse3") static inline __m128i DitherSample4 (const Float32 * inInputBuffer, const Float32 * inErrors, Float32 * outErrors, __m128i * ioSeed,
+															__m128 inScale, __m128 inMin, __m128 inMax, __m128i inShift)
+{
+	const __m128	theOne = _mm_set1_ps(1.0f);
+	const __m128	theMinusOne = _mm_set1_ps(-1.0f);
+	__m128			x = _mm_loadu_ps(inInputBuffer);
+	__m128			target;
+	__m128			nearest;
+	__m128			residual;
+	__m128i			step;
+	__m128			quantized;
+
+	x = _mm_and_ps(x, _mm_cmpord_ps(x, x));
+	x = _mm_max_ps(_mm_min_ps(x, theOne), theMinusOne);
+	target = _mm_mul_ps(x, inScale);
+	if (inErrors)
+	{
+		target = _mm_sub_ps(target, _mm_loadu_ps(inErrors));
+	}
+
+	nearest = _mm_cvtepi32_ps(_mm_cvtps_epi32(target));
+	residual = _mm_add_ps(_mm_add_ps(_mm_sub_ps(target, nearest), NextTPDFDither4(ioSeed)), _mm_set1_ps(0.5f));
+	step = _mm_cvttps_epi32(residual);
+	step = _mm_add_epi32(step, _mm_castps_si128(_mm_cmplt_ps(residual, _mm_cvtepi32_ps(step))));
+	quantized = _mm_max_ps(_mm_min_ps(_mm_add_ps(nearest, _mm_cvtepi32_ps(step)), inMax), inMin);
+	if (outErrors)
+	{
+		_mm_storeu_ps(outErrors, _mm_max_ps(_mm_min_ps(_mm_sub_ps(quantized, target), theOne), theMinusOne));
+	}
+
+	return _mm_sll_epi32(_mm_cvtps_epi32(quantized), inShift);
+}
+
+//	Stores four left justified samples in little endian containers of inBitWidth bits and returns the next output byte.
+CLIP_TARGET("ssse3") static inline UInt8 * StoreSample4LE (__m128i inSamples, UInt32 inBitWidth, UInt8 * outOutputBuffer)
+{
+	switch (inBitWidth)
+	{
+		case 8:
+			inSamples = _mm_srai_epi32(inSamples, 24);
+			inSamples = _mm_packs_epi16(_mm_packs_epi32(inSamples, inSamples), inSamples);
+			*(UInt32 *)outOutputBuffer = (UInt32)_mm_cvtsi128_si32(inSamples);
+			return outOutputBuffer + 4;
+		case 16:
+			inSamples = _mm_srai_epi32(inSamples, 16);
+			_mm_storel_epi64((__m128i *)outOutputBuffer, _mm_packs_epi32(inSamples, inSamples));
+			return outOutputBuffer + 8;
+		case 24:
+			inSamples = _mm_shuffle_epi8(inSamples, _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1));
+			_mm_storel_epi64((__m128i *)outOutputBuffer, inSamples);
+			*(UInt32 *)(outOutputBuffer + 8) = (UInt32)_mm_cvtsi128_si32(_mm_srli_si128(inSamples, 8));
+			return outOutputBuffer + 12;
+		default:
+			_mm_storeu_si128((__m128i *)outOutputBuffer, inSamples);
+			return outOutputBuffer + 16;
+	}
+}
+
+//	Float32 -> dithered SInt8/16/24/32, 8 samples per iteration, in the same pass as the clip.
+//	Two sets of per lane generators alternate so that the xorshift dependency chains overlap. The noise shaper needs the
+//	error of the same channel one frame earlier, so the errors are kept in a scratch history laid out like the samples;
+//	with at least four channels every lane's error is ready before it is needed. Fewer channels with noise shaping, and
+//	the tail of each block, use the scalar step.
+CLIP_TARGET("ssse3") static void ClipFloat32ToDitheredLE_SSSE3(const Float32* inInputBuffer, UInt8* outOutputBuffer, UInt32 inNumberSamples, UInt32 inNumChannels,
+																UInt32 inBitWidth, UInt32 inBitDepth, ClipDitherState * ioState)
+{
+	// Small enough that theErrors can sit under the routed clip's scratch buffer, and at least two frames of
+	// kClipDitherMaxChannels channels.
+	enum { kBlockSamples = 64 };
+
+	const Float32	theScaleScalar	= (Float32)(1 << (inBitDepth - 1));
+	const __m128	theScale		= _mm_set1_ps(theScaleScalar);
+	const __m128	theMax			= _mm_set1_ps(theScaleScalar - 1.0f);
+	const __m128	theMin			= _mm_set1_ps(-theScaleScalar);
+	const __m128i	theShift		= _mm_cvtsi32_si128(32 - inBitDepth);
+	bool			theShape		= (kClipDitherTPDFShaped == ioState->mode) && (inNumChannels <= kClipDitherMaxChannels);
+	Float32			theErrors[kClipDitherMaxChannels + kBlockSamples];
+	__m128i			theSeedA;
+	__m128i			theSeedB;
+	UInt32			theBlockSamples;
+
+	if (theShape && (inNumChannels < 4))
+	{
+		ClipFloat32ToDitheredLE (inInputBuffer, outOutputBuffer, inNumberSamples, inNumChannels, inBitWidth, inBitDepth, ioState);
+		return;
+	}
+
+	// Blocks hold whole frames so that theErrors[0] is always channel 0 of the previous frame.
+	theBlockSamples = theShape ? (UInt32)((kBlockSamples / inNumChannels) * inNumChannels) : (UInt32)kBlockSamples;
+	if (theShape)
+	{
+		for (UInt32 channel = 0; channel < inNumChannels; channel++)
+		{
+			theErrors[channel] = ioState->error[channel];
+		}
+	}
+	theSeedA = _mm_loadu_si128((const __m128i *)&ioState->seed[0]);
+	theSeedB = _mm_loadu_si128((const __m128i *)&ioState->seed[4]);
+
+	while (inNumberSamples > 0)
+	{
+		UInt32		theCount = (inNumberSamples < theBlockSamples) ? inNumberSamples : theBlockSamples;
+		UInt32		theIndex = 0;
+
+		if (theShape)
+		{
+			for (; theIndex + 4 <= theCount; theIndex += 4)
+			{
+				__m128i q = DitherSample4 (inInputBuffer + theIndex, theErrors + theIndex, theErrors + inNumChannels + theIndex, (theIndex & 4) ? &theSeedB : &theSeedA,
+											theScale, theMin, theMax, theShift);
+				outOutputBuffer = StoreSample4LE (q, inBitWidth, outOutputBuffer);
+			}
+		}
+		else
+		{
+			for (; theIndex + 8 <= theCount; theIndex += 8)
+			{
+				__m128i a = DitherSample4 (inInputBuffer + theIndex, NULL, NULL, &theSeedA, theScale, theMin, theMax, theShift);
+				__m128i b = DitherSample4 (inInputBuffer + theIndex + 4, NULL, NULL, &theSeedB, theScale, theMin, theMax, theShift);
+				outOutputBuffer = StoreSample4LE (a, inBitWidth, outOutputBuffer);
+				outOutputBuffer = StoreSample4LE (b, inBitWidth, outOutputBuffer);
+			}
+		}
+
+		if (theIndex < theCount)
+		{
+			// The tail draws from the last lane of theSeedB and hands the advanced state back, so it never repeats
+			// the noise a lane has already produced.
+			UInt32	theTailSeeds[4];
+
+			_mm_storeu_si128((__m128i *)theTailSeeds, theSeedB);
+			for (; theIndex < theCount; theIndex++)
+			{
+				SInt32	theSample;
+
+				if (theShape)
+				{
+					// DitherSample updates the error in place, so start from the one of the previous frame.
+					theErrors[inNumChannels + theIndex] = theErrors[theIndex];
+				}
+				theSample = DitherSample (inInputBuffer[theIndex], theScaleScalar, inBitDepth, &theTailSeeds[3], theShape ? &theErrors[inNumChannels + theIndex] : NULL);
+				outOutputBuffer = StoreSampleLE (theSample, inBitWidth, outOutputBuffer);
+			}
+			theSeedB = _mm_loadu_si128((const __m128i *)theTailSeeds);
+		}
+
+		if (theShape)
+		{
+			for (UInt32 channel = 0; channel < inNumChannels; channel++)
+			{
+				theErrors[channel] = theErrors[theCount + channel];
+			}
+		}
+		inInputBuffer += theCount;
+		inNumberSamples -= theCount;
+	}
+
+	_mm_storeu_si128((__m128i *)&ioState->seed[0], theSeedA);
+	_mm_storeu_si128((__m128i *)&ioState->seed[4], theSeedB);
+	if (theShape)
+	{
+		for (UInt32 channel = 0; channel < inNumChannels; channel++)
+		{
+			ioState->error[channel] = theErrors[channel];
+		}
+	}
+}
+
+//	Planar Float32 -> interleaved SInt24, 4 frames per iteration, for 2 channels or a multiple of 4 channels.
+//	The interleave happens in registers: two channels are zipped with unpacklo/hi, four channels are transposed so that
+//	each vector holds one frame of four adjacent channels, which is exactly 12 contiguous output bytes. The clip is the
+//	one of ClipFloat32ToSInt24LE_SSSE3, and the remaining frames go through the scalar routine a sample at a time, so the
+//	output matches the interleaved routines bit for bit.
+CLIP_TARGET("ssse3") static void ClipPlanarFloat32ToSInt24LE_SSSE3(const Float32 * const * inPlanes, UInt32 inFirstFrame, UInt8 * outOutputBuffer, UInt32 inNumberFrames, UInt32 inNumChannels)
+{
+	const __m128	theMaxClip		= _mm_set1_ps((Float32)kMaxClipSInt24);
+	const __m128	theMinClip		= _mm_set1_ps(-1.0f);
+	const __m128	theScale		= _mm_set1_ps((Float32)kFloat32ToSInt32);
+	const __m128i	thePackMask		= _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+	UInt32			theFrame		= 0;
+
+	if (2 == inNumChannels)
+	{
+		for (; theFrame + 4 <= inNumberFrames; theFrame += 4)
+		{
+			__m128	l = _mm_loadu_ps(inPlanes[0] + inFirstFrame + theFrame);
+			__m128	r = _mm_loadu_ps(inPlanes[1] + inFirstFrame + theFrame);
+			__m128i	a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_unpacklo_ps(l, r))), theScale));
+			__m128i	b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_unpackhi_ps(l, r))), theScale));
+			UInt8 *	theOutput = outOutputBuffer + (theFrame * 6);
+
+			a = _mm_shuffle_epi8(a, thePackMask);
+			b = _mm_shuffle_epi8(b, thePackMask);
+			_mm_storeu_si128((__m128i *)theOutput, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+			_mm_storel_epi64((__m128i *)(theOutput + 16), _mm_srli_si128(b, 4));
+		}
+	}
+	else
+	{
+		for (; theFrame + 4 <= inNumberFrames; theFrame += 4)
+		{
+			for (UInt32 channel = 0; channel < inNumChannels; channel += 4)
+			{
+				__m128	r0 = _mm_loadu_ps(inPlanes[channel + 0] + inFirstFrame + theFrame);
+				__m128	r1 = _mm_loadu_ps(inPlanes[channel + 1] + inFirstFrame + theFrame);
+				__m128	r2 = _mm_loadu_ps(inPlanes[channel + 2] + inFirstFrame + theFrame);
+				__m128	r3 = _mm_loadu_ps(inPlanes[channel + 3] + inFirstFrame + theFrame);
+				__m128	theRows[4];
+
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+				theRows[0] = r0;
+				theRows[1] = r1;
+				theRows[2] = r2;
+				theRows[3] = r3;
+				for (UInt32 row = 0; row < 4; row++)
+				{
+					__m128i	q = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, theRows[row])), theScale));
+					UInt8 *	theOutput = outOutputBuffer + ((((theFrame + row) * inNumChannels) + channel) * 3);
+
+					q = _mm_shuffle_epi8(q, thePackMask);
+					_mm_storel_epi64((__m128i *)theOutput, q);
+					*(UInt32 *)(theOutput + 8) = (UInt32)_mm_cvtsi128_si32(_mm_srli_si128(q, 8));
+				}
+			}
+		}
+	}
+
+	for (; theFrame < inNumberFrames; theFrame++)
+	{
+		for (UInt32 channel = 0; channel < inNumChannels; channel++)
+		{
+			ClipFloat32ToSInt24LE_4(inPlanes[channel] + inFirstFrame + theFrame, (SInt32 *)(outOutputBuffer + (((theFrame * inNumChannels) + channel) * 3)), 1);
+		}
+	}
+}
+
+//	Interleaved SInt24 -> planar Float32, 4 frames per iteration, for 2 channels or a multiple of 4 channels.
+//	The reverse of ClipPlanarFloat32ToSInt24LE_SSSE3: the samples are unpacked as in ConvertSInt24LEToFloat32_SSSE3 and
+//	then split into the planes with shuffles (2 channels) or a 4x4 transpose. Loads never go past the current frames.
+CLIP_TARGET("ssse3") static void ConvertSInt24LEToPlanarFloat32_SSSE3(const UInt8 * inInputBuffer, Float32 * const * outPlanes, UInt32 inNumberFrames, UInt32 inNumChannels)
+{
+	const __m128	theScale		= _mm_set1_ps(kOneOverMaxSInt24Value);
+	const __m128i	theUnpackMask	= _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	UInt32			theFrame		= 0;
+
+	if (2 == inNumChannels)
+	{
+		for (; theFrame + 4 <= inNumberFrames; theFrame += 4)
+		{
+			const UInt8 *	theInput = inInputBuffer + (theFrame * 6);
+			__m128i			x0 = _mm_loadu_si128((const __m128i *)theInput);
+			__m128i			x1 = _mm_loadl_epi64((const __m128i *)(theInput + 16));
+			__m128			a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_shuffle_epi8(x0, theUnpackMask), 8)), theScale);
+			__m128			b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_shuffle_epi8(_mm_alignr_epi8(x1, x0, 12), theUnpackMask), 8)), theScale);
+
+			_mm_storeu_ps(outPlanes[0] + theFrame, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+			_mm_storeu_ps(outPlanes[1] + theFrame, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		}
+	}
+	else
+	{
+		for (; theFrame + 4 <= inNumberFrames; theFrame += 4)
+		{
+			for (UInt32 channel = 0; channel < inNumChannels; channel += 4)
+			{
+				__m128	theRows[4];
+
+				for (UInt32 row = 0; row < 4; row++)
+				{
+					const UInt8 *	theInput = inInputBuffer + ((((theFrame + row) * inNumChannels) + channel) * 3);
+					__m128i			x = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)theInput), _mm_cvtsi32_si128(*(const SInt32 *)(theInput + 8)));
+
+					theRows[row] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_shuffle_epi8(x, theUnpackMask), 8)), theScale);
+				}
+				_MM_TRANSPOSE4_PS(theRows[0], theRows[1], theRows[2], theRows[3]);
+				_mm_storeu_ps(outPlanes[channel + 0] + theFrame, theRows[0]);
+				_mm_storeu_ps(outPlanes[channel + 1] + theFrame, theRows[1]);
+				_mm_storeu_ps(outPlanes[channel + 2] + theFrame, theRows[2]);
+				_mm_storeu_ps(outPlanes[channel + 3] + theFrame, theRows[3]);
+			}
+		}
+	}
+
+	for (; theFrame < inNumberFrames; theFrame++)
+	{
+		for (UInt32 channel = 0; channel < inNumChannels; channel++)
+		{
+			ConvertSInt24LEToFloat32(inInputBuffer + (((theFrame * inNumChannels) + channel) * 3), outPlanes[channel] + theFrame, 1);
+		}
+	}
+}
+
+//	Float32 level meters, 4 samples per step.
+//	The samples are walked in periods of lcm (channels, 4) samples, so that every lane of every vector in a period always
+//	sees the same channel and keeps its own max, sum of squares and clip count. The lanes are folded into the channels at
+//	the end; the single precision sums are flushed to the double precision accumulators every kFlushPeriods periods.
+CLIP_TARGET("sse2") static void MeterFloat32_SSE2(const Float32* inInputBuffer, UInt32 inNumberFrames, UInt32 inNumChannels, Float32 inClipThreshold,
+													Float32 * ioPeak, Float64 * ioSumOfSquares, UInt32 * ioClipCount)
+{
+	enum { kFlushPeriods = 64 };
+
+	const __m128	theAbsMask			= _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128	theThreshold		= _mm_set1_ps(inClipThreshold);
+	const UInt32	thePeriodVectors	= (0 == (inNumChannels % 4)) ? inNumChannels / 4 : (0 == (inNumChannels % 2)) ? inNumChannels / 2 : inNumChannels;
+	const UInt32	thePeriodFrames		= (thePeriodVectors * 4) / inNumChannels;
+	__m128			thePeak[kClipMeterMaxChannels];
+	__m128			theSum[kClipMeterMaxChannels];
+	__m128i			theClips[kClipMeterMaxChannels];
+	UInt32			thePeriods = 0;
+
+	for (UInt32 vector = 0; vector < thePeriodVectors; vector++)
+	{
+		thePeak[vector] = _mm_setzero_ps();
+		theSum[vector] = _mm_setzero_ps();
+		theClips[vector] = _mm_setzero_si128();
+	}
+
+	while (inNumberFrames >= thePeriodFrames)
+	{
+		for (UInt32 vector = 0; vector < thePeriodVectors; vector++)
+		{
+			__m128	x = _mm_loadu_ps(inInputBuffer + (vector * 4));
+			__m128	theLevel;
+
+			x = _mm_and_ps(x, _mm_cmpord_ps(x, x));
+			theLevel = _mm_and_ps(x, theAbsMask);
+			thePeak[vector] = _mm_max_ps(thePeak[vector], theLevel);
+			theSum[vector] = _mm_add_ps(theSum[vector], _mm_mul_ps(x, x));
+			theClips[vector] = _mm_sub_epi32(theClips[vector], _mm_castps_si128(_mm_cmpge_ps(theLevel, theThreshold)));
+		}
+		inInputBuffer += thePeriodVectors * 4;
+		inNumberFrames -= thePeriodFrames;
+
+		if ((++thePeriods == kFlushPeriods) || (inNumberFrames < thePeriodFrames))
+		{
+			for (UInt32 vector = 0; vector < thePeriodVectors; vector++)
+			{
+				Float32	theSums[4];
+
+				_mm_storeu_ps(theSums, theSum[vector]);
+				for (UInt32 lane = 0; lane < 4; lane++)
+				{
+					ioSumOfSquares[((vector * 4) + lane) % inNumChannels] += theSums[lane];
+				}
+				theSum[vector] = _mm_setzero_ps();
+			}
+			thePeriods = 0;
+		}
+	}
+
+	for (UInt32 vector = 0; vector < thePeriodVectors; vector++)
+	{
+		Float32	thePeaks[4];
+		UInt32	theCounts[4];
+
+		_mm_storeu_ps(thePeaks, thePeak[vector]);
+		_mm_storeu_si128((__m128i *)theCounts, theClips[vector]);
+		for (UInt32 lane = 0; lane < 4; lane++)
+		{
+			UInt32	theChannel = ((vector * 4) + lane) % inNumChannels;
+
+			if (thePeaks[lane] > ioPeak[theChannel])
+			{
+				ioPeak[theChannel] = thePeaks[lane];
+			}
+			ioClipCount[theChannel] += theCounts[lane];
+		}
+	}
+
+	MeterFloat32(inInputBuffer, inNumberFrames, inNumChannels, inClipThreshold, ioPeak, ioSumOfSquares, ioClipCount);
+}
+
+#pragma mark -Streaming store clipping routines-
+
+//	Variants of the output clip routines that write the sample buffer with non-temporal stores. The CPU never reads the
+//	USB sample buffer back, so these keep it from evicting the mix and plugin working set; the host controller reads it
+//	from memory either way. Streaming stores must be 16 byte aligned, so a few samples are clipped by the scalar routine
+//	first, and the stores are fenced before returning so that they are globally visible like ordinary ones.
+
+//	Float32 -> SInt16, 16 samples per iteration, streaming.
+CLIP_TARGET("sse2") static void ClipFloat32ToSInt16LE_SSE2_NT(const Float32* inInputBuffer, SInt16* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theMaxClip		= _mm_set1_ps((Float32)kMaxClipSInt16);
+	const __m128	theMinClip		= _mm_set1_ps(-1.0f);
+	const __m128	theScale		= _mm_set1_ps(kFloat32ToSInt16);
+	UInt32			theLeadSamples	= 0;
+
+	while ((theLeadSamples < inNumberSamples) && (0 != (((uintptr_t)(outOutputBuffer + theLeadSamples)) & 15)))
+	{
+		theLeadSamples++;
+	}
+	ClipFloat32ToSInt16LE_4(inInputBuffer, outOutputBuffer, theLeadSamples);
+	inInputBuffer += theLeadSamples;
+	outOutputBuffer += theLeadSamples;
+	inNumberSamples -= theLeadSamples;
+
+	while(inNumberSamples >= 16)
+	{
+		__m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 0))), theScale));
+		__m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 4))), theScale));
+		__m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 8))), theScale));
+		__m128i d = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 12))), theScale));
+
+		inInputBuffer += 16;
+
+		a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		c = _mm_srai_epi32(_mm_slli_epi32(c, 16), 16);
+		d = _mm_srai_epi32(_mm_slli_epi32(d, 16), 16);
+
+		_mm_stream_si128((__m128i *)(outOutputBuffer + 0), _mm_packs_epi32(a, b));
+		_mm_stream_si128((__m128i *)(outOutputBuffer + 8), _mm_packs_epi32(c, d));
+
+		outOutputBuffer += 16;
+		inNumberSamples -= 16;
+	}
+	_mm_sfence();
+
+	ClipFloat32ToSInt16LE_4(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+//	Float32 -> SInt24, 16 samples per iteration, streaming.
+//	Samples are three bytes, so up to 15 leading samples bring the output to a 16 byte boundary.
+CLIP_TARGET("ssse3") static void ClipFloat32ToSInt24LE_SSSE3_NT(const Float32* inInputBuffer, SInt32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theMaxClip		= _mm_set1_ps((Float32)kMaxClipSInt24);
+	const __m128	theMinClip		= _mm_set1_ps(-1.0f);
+	const __m128	theScale		= _mm_set1_ps((Float32)kFloat32ToSInt32);
+	const __m128i	thePackMask		= _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+	UInt8 *			theOutputBuffer	= (UInt8 *)outOutputBuffer;
+	UInt32			theLeadSamples	= 0;
+
+	while ((theLeadSamples < inNumberSamples) && (0 != (((uintptr_t)(theOutputBuffer + (theLeadSamples * 3))) & 15)))
+	{
+		theLeadSamples++;
+	}
+	ClipFloat32ToSInt24LE_4(inInputBuffer, (SInt32*)theOutputBuffer, theLeadSamples);
+	inInputBuffer += theLeadSamples;
+	theOutputBuffer += theLeadSamples * 3;
+	inNumberSamples -= theLeadSamples;
+
+	while(inNumberSamples >= 16)
+	{
+		__m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 0))), theScale));
+		__m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 4))), theScale));
+		__m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 8))), theScale));
+		__m128i d = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, _mm_min_ps(theMaxClip, _mm_loadu_ps(inInputBuffer + 12))), theScale));
+
+		inInputBuffer += 16;
+
+		a = _mm_shuffle_epi8(a, thePackMask);
+		b = _mm_shuffle_epi8(b, thePackMask);
+		c = _mm_shuffle_epi8(c, thePackMask);
+		d = _mm_shuffle_epi8(d, thePackMask);
+
+		_mm_stream_si128((__m128i *)(theOutputBuffer + 0), _mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_stream_si128((__m128i *)(theOutputBuffer + 16), _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_stream_si128((__m128i *)(theOutputBuffer + 32), _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+
+		theOutputBuffer += 48;
+		inNumberSamples -= 16;
+	}
+	_mm_sfence();
+
+	ClipFloat32ToSInt24LE_4(inInputBuffer, (SInt32*)theOutputBuffer, inNumberSamples);
+}
+
+//	Float32 -> SInt32, 8 samples per iteration, streaming.
+CLIP_TARGET("sse2") static void ClipFloat32ToSInt32LE_SSE2_NT(const Float32* inInputBuffer, SInt32* outOutputBuffer, UInt32 inNumberSamples)
+{
+	const __m128	theMinClip		= _mm_set1_ps(-1.0f);
+	const __m128	theOne			= _mm_set1_ps(1.0f);
+	const __m128	theScale		= _mm_set1_ps((Float32)kFloat32ToSInt32);
+	const __m128i	theMaxValue		= _mm_set1_epi32((SInt32)(kMaxClipSInt32 * kFloat32ToSInt32));
+	UInt32			theLeadSamples	= 0;
+
+	while ((theLeadSamples < inNumberSamples) && (0 != (((uintptr_t)(outOutputBuffer + theLeadSamples)) & 15)))
+	{
+		theLeadSamples++;
+	}
+	ClipFloat32ToSInt32LE_4(inInputBuffer, outOutputBuffer, theLeadSamples);
+	inInputBuffer += theLeadSamples;
+	outOutputBuffer += theLeadSamples;
+	inNumberSamples -= theLeadSamples;
+
+	while(inNumberSamples >= 8)
+	{
+		__m128	x0 = _mm_loadu_ps(inInputBuffer + 0);
+		__m128	x1 = _mm_loadu_ps(inInputBuffer + 4);
+		__m128i	clip0 = _mm_castps_si128(_mm_cmpge_ps(x0, theOne));
+		__m128i	clip1 = _mm_castps_si128(_mm_cmpge_ps(x1, theOne));
+		__m128i	a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, x0), theScale));
+		__m128i	b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(theMinClip, x1), theScale));
+
+		inInputBuffer += 8;
+
+		_mm_stream_si128((__m128i *)(outOutputBuffer + 0), _mm_or_si128(_mm_andnot_si128(clip0, a), _mm_and_si128(clip0, theMaxValue)));
+		_mm_stream_si128((__m128i *)(outOutputBuffer + 4), _mm_or_si128(_mm_andnot_si128(clip1, b), _mm_and_si128(clip1, theMaxValue)));
+
+		outOutputBuffer += 8;
+		inNumberSamples -= 8;
+	}
+	_mm_sfence();
+
+	ClipFloat32ToSInt32LE_4(inInputBuffer, outOutputBuffer, inNumberSamples);
+}
+
+#pragma mark -Clip routine dispatch-
+
+//	Clip and convert routines share one signature so that they can be kept in a single table, indexed by direction and
+//	sample width. The table starts out with the scalar routines and is filled in by SetClipRoutineTier ().
+typedef void (*SampleRoutine)(const void * inInputBuffer, void * outOutputBuffer, UInt32 inNumberSamples);
+
+enum
+{
+	kSampleDirectionOutput			= 0,
+	kSampleDirectionInput,
+	kNumSampleDirections
+};
+
+enum
+{
+	kSampleWidth8					= 0,
+	kSampleWidth16,
+	kSampleWidth24,
+	kSampleWidth32,
+	kNumSampleWidths
+};
+
+static SampleRoutine	sSampleRoutines[kNumSampleDirections][kNumSampleWidths] =
+{
+	{
+		(SampleRoutine)ClipFloat32ToSInt8_4,
+		(SampleRoutine)ClipFloat32ToSInt16LE_4,
+		(SampleRoutine)ClipFloat32ToSInt24LE_4,
+		(SampleRoutine)ClipFloat32ToSInt32LE_4
+	},
+	{
+		(SampleRoutine)ConvertSInt8ToFloat32,
+		(SampleRoutine)ConvertSInt16LEToFloat32,
+		(SampleRoutine)ConvertSInt24LEToFloat32,
+		(SampleRoutine)ConvertSInt32LEToFloat32
+	}
+};
+
+//	Streaming store versions of the output routines, NULL for a width without one. They are used for writes of at least
+//	sStreamingClipMinBytes; below that the alignment prologue and the fence cost more than the cache lines saved.
+#define	kStreamingClipMinBytes		4096
+
+static SampleRoutine	sStreamingRoutines[kNumSampleWidths] = { NULL, NULL, NULL, NULL };
+static UInt32			sStreamingClipMinBytes = kStreamingClipMinBytes;
+
+static inline SampleRoutine GetClipSampleRoutine (UInt32 inWidth, UInt32 inNumberBytes)
+{
+	SampleRoutine	routine = sStreamingRoutines[inWidth];
+
+	if ((NULL == routine) || (inNumberBytes < sStreamingClipMinBytes))
+	{
+		routine = sSampleRoutines[kSampleDirectionOutput][inWidth];
+	}
+	return routine;
+}
+
+//	Fused planar routines for 20 and 24 bit samples, NULL below the tier that has them.
+typedef void (*PlanarClipRoutine)(const Float32 * const * inPlanes, UInt32 inFirstFrame, UInt8 * outOutputBuffer, UInt32 inNumberFrames, UInt32 inNumChannels);
+typedef void (*PlanarConvertRoutine)(const UInt8 * inInputBuffer, Float32 * const * outPlanes, UInt32 inNumberFrames, UInt32 inNumChannels);
+
+static PlanarClipRoutine	sPlanarClipRoutine = NULL;
+static PlanarConvertRoutine	sPlanarConvertRoutine = NULL;
+#endif
+
+static UInt32	sClipRoutineTier = kClipRoutineTierScalar;
+static UInt32	sMaxVerifiedClipRoutineTier = kClipRoutineTierAVX512;
+static bool		sIntegerClipRoutinesVerified = true;
+
+static const char *	sClipRoutineTierNames[kClipRoutineTierCount] = { "scalar", "SSE2", "SSSE3", "AVX2", "AVX-512", "integer" };
+
+//	Returns the best tier the processor supports and whose routines passed verification.
+UInt32 GetMaxClipRoutineTier (void)
+{
+	UInt32	tier = kClipRoutineTierScalar;
+
+#if defined(__i386__) || defined(__x86_64__)
+	UInt32	features = CPUFeatures ();
+
+	if (features & kCPUFeatureSSE2)
+	{
+		tier = kClipRoutineTierSSE2;
+		if (features & kCPUFeatureSSSE3)
+		{
+			tier = kClipRoutineTierSSSE3;
+			if (features & kCPUFeatureAVX2)
+			{
+				tier = kClipRoutineTierAVX2;
+				if (features & kCPUFeatureAVX512)
+				{
+					tier = kClipRoutineTierAVX512;
+				}
+			}
+		}
+	}
+#endif
+	if (tier > sMaxVerifiedClipRoutineTier)
+	{
+		tier = sMaxVerifiedClipRoutineTier;
+	}
+
+	return tier;
+}
+
+UInt32 GetClipRoutineTier (void)
+{
+	return sClipRoutineTier;
+}
+
+const char * GetClipRoutineTierName (UInt32 inTier)
+{
+	return (inTier < kClipRoutineTierCount) ? sClipRoutineTierNames[inTier] : "unknown";
+}
+
+//	Selects the routines of the given tier, or of the best supported tier if the processor can't run it. Each tier only
+//	replaces the routines it has a kernel for, so a width without one keeps the routine of the tier below it. Returns the
+//	tier actually selected. Forcing a lower tier is how each set of routines gets verified and benchmarked on one machine.
+//	The integer tier replaces the scalar clip and convert routines and keeps the scalar dither and metering routines.
+UInt32 SetClipRoutineTier (UInt32 inTier)
+{
+	UInt32	maxTier = GetMaxClipRoutineTier ();
+
+	if ((inTier > maxTier) && ((kClipRoutineTierInteger != inTier) || !sIntegerClipRoutinesVerified))
+	{
+		inTier = maxTier;
+	}
+
+#if defined(__i386__) || defined(__x86_64__)
+	UInt32					vectorTier = (kClipRoutineTierInteger == inTier) ? (UInt32)kClipRoutineTierScalar : (UInt32)inTier;
+	SampleRoutine			output[kNumSampleWidths];
+	SampleRoutine			input[kNumSampleWidths];
+	SampleRoutine			streaming[kNumSampleWidths] = { NULL, NULL, NULL, NULL };
+	DitherRoutine			dither = ClipFloat32ToDitheredLE;
+	MeterRoutine			meter = MeterFloat32;
+	PlanarClipRoutine		planarClip = NULL;
+	PlanarConvertRoutine	planarConvert = NULL;
+
+	output[kSampleWidth8] = (SampleRoutine)ClipFloat32ToSInt8_4;
+	output[kSampleWidth16] = (SampleRoutine)ClipFloat32ToSInt16LE_4;
+	output[kSampleWidth24] = (SampleRoutine)ClipFloat32ToSInt24LE_4;
+	output[kSampleWidth32] = (SampleRoutine)ClipFloat32ToSInt32LE_4;
+	input[kSampleWidth8] = (SampleRoutine)ConvertSInt8ToFloat32;
+	input[kSampleWidth16] = (SampleRoutine)ConvertSInt16LEToFloat32;
+	input[kSampleWidth24] = (SampleRoutine)ConvertSInt24LEToFloat32;
+	input[kSampleWidth32] = (SampleRoutine)ConvertSInt32LEToFloat32;
+
+	if (vectorTier >= kClipRoutineTierSSE2)
+	{
+		output[kSampleWidth8] = (SampleRoutine)ClipFloat32ToSInt8_SSE2;
+		output[kSampleWidth16] = (SampleRoutine)ClipFloat32ToSInt16LE_SSE2;
+		output[kSampleWidth32] = (SampleRoutine)ClipFloat32ToSInt32LE_SSE2;
+		input[kSampleWidth8] = (SampleRoutine)ConvertSInt8ToFloat32_SSE2;
+		input[kSampleWidth16] = (SampleRoutine)ConvertSInt16LEToFloat32_SSE2;
+		input[kSampleWidth32] = (SampleRoutine)ConvertSInt32LEToFloat32_SSE2;
+		meter = MeterFloat32_SSE2;
+		streaming[kSampleWidth16] = (SampleRoutine)ClipFloat32ToSInt16LE_SSE2_NT;
+		streaming[kSampleWidth32] = (SampleRoutine)ClipFloat32ToSInt32LE_SSE2_NT;
+	}
+	if (vectorTier >= kClipRoutineTierSSSE3)
+	{
+		output[kSampleWidth24] = (SampleRoutine)ClipFloat32ToSInt24LE_SSSE3;
+		input[kSampleWidth24] = (SampleRoutine)ConvertSInt24LEToFloat32_SSSE3;
+		dither = ClipFloat32ToDitheredLE_SSSE3;
+		streaming[kSampleWidth24] = (SampleRoutine)ClipFloat32ToSInt24LE_SSSE3_NT;
+		planarClip = ClipPlanarFloat32ToSInt24LE_SSSE3;
+		planarConvert = ConvertSInt24LEToPlanarFloat32_SSSE3;
+	}
+	if (vectorTier >= kClipRoutineTierAVX2)
+	{
+		output[kSampleWidth24] = (SampleRoutine)ClipFloat32ToSInt24LE_AVX2;
+		input[kSampleWidth24] = (SampleRoutine)ConvertSInt24LEToFloat32_AVX2;
+	}
+	if (vectorTier >= kClipRoutineTierAVX512)
+	{
+		output[kSampleWidth24] = (SampleRoutine)ClipFloat32ToSInt24LE_AVX512;
+		input[kSampleWidth24] = (SampleRoutine)ConvertSInt24LEToFloat32_AVX512;
+	}
+	if (kClipRoutineTierInteger == inTier)
+	{
+		output[kSampleWidth8] = (SampleRoutine)ClipFloat32ToSInt8_Int;
+		output[kSampleWidth16] = (SampleRoutine)ClipFloat32ToSInt16LE_Int;
+		output[kSampleWidth24] = (SampleRoutine)ClipFloat32ToSInt24LE_Int;
+		output[kSampleWidth32] = (SampleRoutine)ClipFloat32ToSInt32LE_Int;
+		input[kSampleWidth8] = (SampleRoutine)ConvertSInt8ToFloat32_Int;
+		input[kSampleWidth16] = (SampleRoutine)ConvertSInt16LEToFloat32_Int;
+		input[kSampleWidth24] = (SampleRoutine)ConvertSInt24LEToFloat32_Int;
+		input[kSampleWidth32] = (SampleRoutine)ConvertSInt32LEToFloat32_Int;
+	}
+
+	for (UInt32 width = 0; width < kNumSampleWidths; width++)
+	{
+		sSampleRoutines[kSampleDirectionOutput][width] = output[width];
+		sSampleRoutines[kSampleDirectionInput][width] = input[width];
+		sStreamingRoutines[width] = streaming[width];
+	}
+	sDitherRoutine = dither;
+	sMeterRoutine = meter;
+	sPlanarClipRoutine = planarClip;
+	sPlanarConvertRoutine = planarConvert;
+#endif
+
+	sClipRoutineTier = inTier;
+	return inTier;
+}
+
+#pragma mark -Clip routine verification-
+
+#if VERIFYCLIPROUTINES && (defined(__i386__) || defined(__x86_64__))
+//	Every vectorized routine but the dithered clip has to match the scalar routine of its kind bit for bit. At startup
+//	each tier is run against the scalar routines on the values that broke converters before (NaN, infinities, denormals,
+//	both sides of +/-1.0 and of each width's clip point) mixed with random bit patterns and random samples, at several
+//	lengths and output alignments. The first tier with a routine that differs, and every tier above it, is never selected.
+#define	kVerifySamples				1024
+#define	kVerifyGuardBytes			16
+
+static const UInt32		sVerifyEdgeValues[] =
+{
+	0x00000000, 0x80000000,						// +/-0
+	0x00000001, 0x807FFFFF,						// denormals
+	0x00800000, 0x80800000,						// +/-FLT_MIN
+	0x3F800000, 0xBF800000,						// +/-1.0
+	0x3F7FFFFF, 0xBF7FFFFF,						// just inside +/-1.0
+	0x3F800001, 0xBF800001,						// just outside +/-1.0
+	0x4F000000, 0xCF000000,						// +/-2^31
+	0x7F7FFFFF, 0xFF7FFFFF,						// +/-FLT_MAX
+	0x7F800000, 0xFF800000,						// +/-infinity
+	0x7FC00000, 0xFFC00000, 0x7F800001			// quiet, negative and signalling NaN
+};
+
+static const SampleRoutine	sScalarSampleRoutines[kNumSampleDirections][kNumSampleWidths] =
+{
+	{
+		(SampleRoutine)ClipFloat32ToSInt8_4,
+		(SampleRoutine)ClipFloat32ToSInt16LE_4,
+		(SampleRoutine)ClipFloat32ToSInt24LE_4,
+		(SampleRoutine)ClipFloat32ToSInt32LE_4
+	},
+	{
+		(SampleRoutine)ConvertSInt8ToFloat32,
+		(SampleRoutine)ConvertSInt16LEToFloat32,
+		(SampleRoutine)ConvertSInt24LEToFloat32,
+		(SampleRoutine)ConvertSInt32LEToFloat32
+	}
+};
+
+static bool				sClipRoutinesVerified = false;
+
+//	Runs inRoutine and the scalar inReference over the same input and compares the outputs, including the guard bytes
+//	past the end so that an overrun is caught as well.
+static bool VerifySampleRoutine (const char * inName, UInt32 inWidth, SampleRoutine inRoutine, SampleRoutine inReference, const void * inInput,
+									UInt32 inOutputBytesPerSample, UInt8 * outExpected, UInt8 * outActual)
+{
+	static const UInt32		kOffsets[] = { 0, 1, 7 };
+	static const UInt32		kCounts[] = { kVerifySamples, kVerifySamples - 13, 3 };
+
+	for (UInt32 offsetIndex = 0; offsetIndex < sizeof (kOffsets) / sizeof (kOffsets[0]); offsetIndex++)
+	{
+		for (UInt32 countIndex = 0; countIndex < sizeof (kCounts) / sizeof (kCounts[0]); countIndex++)
+		{
+			UInt32	theBytes = kOffsets[offsetIndex] + (kCounts[countIndex] * inOutputBytesPerSample) + kVerifyGuardBytes;
+
+			memset (outExpected, 0x5A, theBytes);
+			memset (outActual, 0x5A, theBytes);
+			inReference (inInput, outExpected + kOffsets[offsetIndex], kCounts[countIndex]);
+			inRoutine (inInput, outActual + kOffsets[offsetIndex], kCounts[countIndex]);
+			if (0 != memcmp (outExpected, outActual, theBytes))
+			{
+				IOLog ("VerifyClipRoutines: %s %s routine for width index %u differs from the scalar routine (%u samples at offset %u)\n",
+						GetClipRoutineTierName (sClipRoutineTier), inName, (unsigned int)inWidth, (unsigned int)kCounts[countIndex], (unsigned int)kOffsets[offsetIndex]);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+//	Checks the fused planar 24 bit routines against the scalar interleaved ones. inFloats is taken as inNumChannels planes.
+static bool VerifyPlanarRoutines (UInt32 inNumChannels, UInt32 inNumberFrames, Float32 * inFloats, const UInt8 * inBytes, Float32 * ioInterleaved, UInt8 * outExpected, UInt8 * outActual)
+{
+	Float32 *	thePlanes[8];
+	UInt32		theBytes = (inNumberFrames * inNumChannels * 3) + kVerifyGuardBytes;
+
+	for (UInt32 channel = 0; channel < inNumChannels; channel++)
+	{
+		thePlanes[channel] = inFloats + (channel * inNumberFrames);
+		for (UInt32 frame = 0; frame < inNumberFrames; frame++)
+		{
+			ioInterleaved[(frame * inNumChannels) + channel] = thePlanes[channel][frame];
+		}
+	}
+	memset (outExpected, 0x5A, theBytes);
+	memset (outActual, 0x5A, theBytes);
+	ClipFloat32ToSInt24LE_4 (ioInterleaved, (SInt32 *)outExpected, inNumberFrames * inNumChannels);
+	sPlanarClipRoutine (thePlanes, 0, outActual, inNumberFrames, inNumChannels);
+	if (0 != memcmp (outExpected, outActual, theBytes))
+	{
+		IOLog ("VerifyClipRoutines: %s planar clip routine for %u channels differs from the scalar routine\n", GetClipRoutineTierName (sClipRoutineTier), (unsigned int)inNumChannels);
+		return false;
+	}
+
+	ConvertSInt24LEToFloat32 (inBytes, ioInterleaved, inNumberFrames * inNumChannels);
+	for (UInt32 channel = 0; channel < inNumChannels; channel++)
+	{
+		thePlanes[channel] = ((Float32 *)outActual) + (channel * inNumberFrames);
+	}
+	sPlanarConvertRoutine (inBytes, thePlanes, inNumberFrames, inNumChannels);
+	for (UInt32 frame = 0; frame < inNumberFrames; frame++)
+	{
+		for (UInt32 channel = 0; channel < inNumChannels; channel++)
+		{
+			if (0 != memcmp (&ioInterleaved[(frame * inNumChannels) + channel], &thePlanes[channel][frame], sizeof (Float32)))
+			{
+				IOLog ("VerifyClipRoutines: %s planar convert routine for %u channels differs from the scalar routine\n", GetClipRoutineTierName (sClipRoutineTier), (unsigned int)inNumChannels);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+//	The dithered routines draw their noise in a different order than the scalar one, so they can't be compared bit for
+//	bit. Instead every sample has to land within the bound of the scalar step from its clipped target (1.5 LSB with
+//	TPDF dither, 2.5 with noise shaping), and samples halfway between two 24 bit steps must come out without a bias,
+//	which is where single precision rounding of the dither shows. Even and odd steps are summed apart so that a
+//	round half to even bias doesn't cancel out.
+static bool VerifyDitherRoutine (const Float32 * inFloats, Float32 * ioTies, UInt8 * outActual)
+{
+	static const UInt32		kChannels[] = { 4, 6, kClipDitherMaxChannels };
+	static const UInt32		kWidths[] = { 16, 24, 32 };
+	static const UInt32		kDepths[] = { 16, 24, 24 };
+	ClipDitherState			state;
+	Float64					tieSums[2] = { 0.0, 0.0 };
+	UInt32					tieCounts[2] = { 0, 0 };
+	UInt32					seed = 0x6D2B79F5;
+
+	for (UInt32 mode = kClipDitherTPDF; mode <= kClipDitherTPDFShaped; mode++)
+	{
+		for (UInt32 channelIndex = 0; channelIndex < sizeof (kChannels) / sizeof (kChannels[0]); channelIndex++)
+		{
+			for (UInt32 widthIndex = 0; widthIndex < sizeof (kWidths) / sizeof (kWidths[0]); widthIndex++)
+			{
+				UInt32		theSamples = (kVerifySamples / kChannels[channelIndex]) * kChannels[channelIndex];
+				UInt32		theBytes = kWidths[widthIndex] / 8;
+				Float64		theScale = (Float64)(1 << (kDepths[widthIndex] - 1));
+				Float64		theLimit = (kClipDitherTPDF == mode) ? 1.5 : 2.5;
+
+				InitClipDitherState (&state, mode);
+				sDitherRoutine (inFloats, outActual, theSamples, kChannels[channelIndex], kWidths[widthIndex], kDepths[widthIndex], &state);
+				for (UInt32 i = 0; i < theSamples; i++)
+				{
+					Float32		sample = inFloats[i];
+					Float64		target;
+					Float64		deviation;
+					UInt32		bits = 0;
+
+					if (sample != sample)
+					{
+						sample = 0.0f;
+					}
+					sample = (sample > 1.0f) ? 1.0f : ((sample < -1.0f) ? -1.0f : sample);
+					target = (Float64)sample * theScale;
+					if (target > theScale - 1.0)
+					{
+						target = theScale - 1.0;
+					}
+					for (UInt32 byte = 0; byte < theBytes; byte++)
+					{
+						bits |= (UInt32)outActual[(i * theBytes) + byte] << (32 - kWidths[widthIndex] + (8 * byte));
+					}
+					deviation = (Float64)((SInt32)bits >> (32 - kDepths[widthIndex])) - target;
+					if ((deviation > theLimit) || (deviation < -theLimit))
+					{
+						IOLog ("VerifyClipRoutines: %s dither routine (mode %u, %u channels, width %u) is %d/1000 LSB off at sample %u\n", GetClipRoutineTierName (sClipRoutineTier),
+								(unsigned int)mode, (unsigned int)kChannels[channelIndex], (unsigned int)kWidths[widthIndex], (int)(deviation * 1000.0), (unsigned int)i);
+						return false;
+					}
+				}
+			}
+		}
+	}
+
+	for (UInt32 i = 0; i < kVerifySamples; i++)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		ioTies[i] = ((Float32)(SInt32)((seed >> 8) - 0x00800000) + 0.5f) * (1.0f / 8388608.0f);
+	}
+	InitClipDitherState (&state, kClipDitherTPDF);
+	sDitherRoutine (ioTies, outActual, kVerifySamples, 8, 24, 24, &state);
+	for (UInt32 i = 0; i < kVerifySamples; i++)
+	{
+		Float64		target = (Float64)ioTies[i] * 8388608.0;
+		UInt32		bits = ((UInt32)outActual[i * 3] << 8) | ((UInt32)outActual[(i * 3) + 1] << 16) | ((UInt32)outActual[(i * 3) + 2] << 24);
+		UInt32		parity = (UInt32)((SInt32)(target - 0.5)) & 1;
+
+		tieSums[parity] += (Float64)((SInt32)bits >> 8) - target;
+		tieCounts[parity]++;
+	}
+	for (UInt32 parity = 0; parity < 2; parity++)
+	{
+		if ((0 != tieCounts[parity]) && ((tieSums[parity] > 0.1 * tieCounts[parity]) || (tieSums[parity] < -0.1 * tieCounts[parity])))
+		{
+			IOLog ("VerifyClipRoutines: %s dither routine is biased by %d/1000 LSB halfway between steps\n", GetClipRoutineTierName (sClipRoutineTier),
+					(int)((tieSums[parity] * 1000.0) / tieCounts[parity]));
+			return false;
+		}
+	}
+	return true;
+}
+
+//	Returns the best tier whose routines, and those of every tier below it, match the scalar routines.
+static UInt32 VerifyClipRoutines (void)
+{
+	static const UInt32		kBytesPerSample[kNumSampleWidths] = { 1, 2, 3, 4 };
+	const UInt32			kBufferBytes = (kVerifySamples * sizeof (Float32)) + kVerifyGuardBytes + 8;
+	Float32 *				floats = NULL;
+	Float32 *				interleaved = NULL;
+	UInt8 *					bytes = NULL;
+	UInt8 *					expected = NULL;
+	UInt8 *					actual = NULL;
+	static const Float32	kClipPoints[] = { (Float32)kMaxClipSInt8, (Float32)kMaxClipSInt16, (Float32)kMaxClipSInt24 };
+	UInt32					verifiedTier = GetMaxClipRoutineTier ();
+	UInt32					seed = 0x2545F491;
+
+	floats = (Float32 *)IOMalloc (kBufferBytes);
+	FailIf (NULL == floats, Exit);
+	interleaved = (Float32 *)IOMalloc (kBufferBytes);
+	FailIf (NULL == interleaved, Exit);
+	bytes = (UInt8 *)IOMalloc (kBufferBytes);
+	FailIf (NULL == bytes, Exit);
+	expected = (UInt8 *)IOMalloc (kBufferBytes);
+	FailIf (NULL == expected, Exit);
+	actual = (UInt8 *)IOMalloc (kBufferBytes);
+	FailIf (NULL == actual, Exit);
+
+	// Of every four samples one is an edge value, one is the clip point of the 8, 16 or 24 bit routines or one of its
+	// neighbours, one is a random bit pattern and one a random sample in [-1.25, 1.25), so that all of them land in every
+	// vector lane.
+	for (UInt32 i = 0; i < kVerifySamples; i++)
+	{
+		UInt32	bits;
+
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		switch (i % 4)
+		{
+			case 0:
+				bits = sVerifyEdgeValues[(i / 4) % (sizeof (sVerifyEdgeValues) / sizeof (sVerifyEdgeValues[0]))];
+				break;
+			case 1:
+				memcpy (&bits, &kClipPoints[(i / 4) % 3], sizeof (bits));
+				bits += (seed % 3) - 1;
+				if (seed & 0x100)
+				{
+					bits |= 0x80000000;
+				}
+				break;
+			case 2:
+				bits = seed;
+				break;
+			default:
+				{
+					Float32	sample = (Float32)(SInt32)seed * (1.25f / 2147483648.0f);
+
+					memcpy (&bits, &sample, sizeof (bits));
+				}
+				break;
+		}
+		memcpy (&floats[i], &bits, sizeof (bits));
+		memcpy (&bytes[i * 4], &seed, sizeof (seed));
+	}
+
+	verifiedTier = kClipRoutineTierScalar;
+	for (UInt32 tier = kClipRoutineTierSSE2; tier <= GetMaxClipRoutineTier (); tier++)
+	{
+		bool	ok = true;
+
+		SetClipRoutineTier (tier);
+		for (UInt32 width = 0; (width < kNumSampleWidths) && ok; width++)
+		{
+			ok = VerifySampleRoutine ("clip", width, sSampleRoutines[kSampleDirectionOutput][width], sScalarSampleRoutines[kSampleDirectionOutput][width],
+										floats, kBytesPerSample[width], expected, actual)
+				&& VerifySampleRoutine ("convert", width, sSampleRoutines[kSampleDirectionInput][width], sScalarSampleRoutines[kSampleDirectionInput][width],
+										bytes, sizeof (Float32), expected, actual);
+			if (ok && (NULL != sStreamingRoutines[width]))
+			{
+				ok = VerifySampleRoutine ("streaming clip", width, sStreamingRoutines[width], sScalarSampleRoutines[kSampleDirectionOutput][width],
+											floats, kBytesPerSample[width], expected, actual);
+			}
+		}
+		if (ok && (NULL != sPlanarClipRoutine))
+		{
+			ok =	VerifyPlanarRoutines (2, (kVerifySamples / 2) - 3, floats, bytes, interleaved, expected, actual)
+				&&	VerifyPlanarRoutines (8, (kVerifySamples / 8) - 3, floats, bytes, interleaved, expected, actual);
+		}
+		if (ok && (ClipFloat32ToDitheredLE != sDitherRoutine))
+		{
+			ok = VerifyDitherRoutine (floats, interleaved, actual);
+		}
+		if (!ok)
+		{
+			break;
+		}
+		verifiedTier = tier;
+	}
+
+	// The integer routines are not part of the progression, so a difference there only takes the integer tier out.
+	SetClipRoutineTier (kClipRoutineTierInteger);
+	for (UInt32 width = 0; (width < kNumSampleWidths) && sIntegerClipRoutinesVerified; width++)
+	{
+		sIntegerClipRoutinesVerified =	VerifySampleRoutine ("clip", width, sSampleRoutines[kSampleDirectionOutput][width], sScalarSampleRoutines[kSampleDirectionOutput][width],
+															floats, kBytesPerSample[width], expected, actual)
+									&&	VerifySampleRoutine ("convert", width, sSampleRoutines[kSampleDirectionInput][width], sScalarSampleRoutines[kSampleDirectionInput][width],
+															bytes, sizeof (Float32), expected, actual);
+	}
+
+Exit:
+	if (NULL != actual)
+	{
+		IOFree (actual, kBufferBytes);
+	}
+	if (NULL != expected)
+	{
+		IOFree (expected, kBufferBytes);
+	}
+	if (NULL != bytes)
+	{
+		IOFree (bytes, kBufferBytes);
+	}
+	if (NULL != interleaved)
+	{
+		IOFree (interleaved, kBufferBytes);
+	}
+	if (NULL != floats)
+	{
+		IOFree (floats, kBufferBytes);
+	}
+	return verifiedTier;
+}
+#endif
+
+#if BENCHMARKCLIPROUTINES
+static bool				sClipRoutinesBenchmarked = false;
+#endif
+
+//	Called from the start of every device. The verification and the benchmark switch the global routines through every
+//	tier, so they only run on the first call, before any stream is running; later calls just select the tier again.
+void InitClipRoutines (void)
+{
+	UInt32	tier;
+
+#if VERIFYCLIPROUTINES && (defined(__i386__) || defined(__x86_64__))
+	if (!sClipRoutinesVerified)
+	{
+		sMaxVerifiedClipRoutineTier = VerifyClipRoutines ();
+		sClipRoutinesVerified = true;
+	}
+#endif
+
+#if FORCECLIPROUTINETIER
+	tier = SetClipRoutineTier (kForcedClipRoutineTier);
+#else
+	tier = SetClipRoutineTier (GetMaxClipRoutineTier ());
+#endif
+
+	debugIOLog ("InitClipRoutines: using %s clip routines (best supported: %s)", GetClipRoutineTierName (tier), GetClipRoutineTierName (GetMaxClipRoutineTier ()));
+
+#if BENCHMARKCLIPROUTINES
+	if (!sClipRoutinesBenchmarked)
+	{
+		BenchmarkClipRoutines ();
+		sClipRoutinesBenchmarked = true;
+	}
+#endif
+}
+
+#if BENCHMARKCLIPROUTINES
+static inline UInt64 ReadCycleCounter (void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	UInt32 lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((UInt64)hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+//	Cache cost of the output clip on a concurrent mix. Each round runs a mix-like pass over a working set that fits in the
+//	cache and then clips one engine buffer into a ring much larger than the cache, like the USB sample buffer. The time of
+//	the mix pass goes up with every line of it the clip evicts; it is logged with ordinary and with streaming stores.
+static void BenchmarkStreamingClip (void)
+{
+	const UInt32			kChannels = 8;
+	const UInt32			kFramesPerRound = 512;
+	const UInt32			kRounds = 4096;
+	const UInt32			kMixSamples = 64 * 1024;					// 2 x 256 KB of Float32
+	const UInt32			kRingBytes = 64 * 1024 * 1024;
+	Float32 *				mixSource = NULL;
+	Float32 *				mixDest = NULL;
+	UInt8 *					ring = NULL;
+	IOAudioStreamFormat		format;
+	UInt32					savedMinBytes = sStreamingClipMinBytes;
+
+	mixSource = (Float32 *)IOMallocAligned (kMixSamples * sizeof (Float32), 64);
+	FailIf (NULL == mixSource, Exit);
+	mixDest = (Float32 *)IOMallocAligned (kMixSamples * sizeof (Float32), 64);
+	FailIf (NULL == mixDest, Exit);
+	ring = (UInt8 *)IOMallocAligned (kRingBytes, 64);
+	FailIf (NULL == ring, Exit);
+
+	for (UInt32 i = 0; i < kMixSamples; i++)
+	{
+		mixSource[i] = (Float32)(i % 1000) * 0.001f - 0.5f;
+		mixDest[i] = 0.0f;
+	}
+	bzero (ring, kRingBytes);
+	bzero (&format, sizeof (format));
+	format.fNumChannels = kChannels;
+
+	for (UInt32 width = 16; width <= 32; width += 8)
+	{
+		UInt32	roundBytes = kFramesPerRound * kChannels * (width / 8);
+
+		format.fBitWidth = width;
+		format.fBitDepth = width;
+		for (UInt32 streaming = 0; streaming < 2; streaming++)
+		{
+			UInt64	mixCycles = 0;
+			UInt64	clipCycles = 0;
+			UInt32	ringOffset = 0;
+
+			sStreamingClipMinBytes = streaming ? 0 : 0xFFFFFFFF;
+			for (UInt32 round = 0; round < kRounds; round++)
+			{
+				UInt64	startCycles = ReadCycleCounter ();
+
+				for (UInt32 i = 0; i < kMixSamples; i++)
+				{
+					mixDest[i] = (mixDest[i] * 0.5f) + mixSource[i];
+				}
+
+				UInt64	midCycles = ReadCycleCounter ();
+
+				clipAudioToOutputStream (mixSource, ring + ringOffset, 0, kFramesPerRound, &format);
+				clipCycles += ReadCycleCounter () - midCycles;
+				mixCycles += midCycles - startCycles;
+				ringOffset += roundBytes;
+				if (ringOffset + roundBytes > kRingBytes)
+				{
+					ringOffset = 0;
+				}
+			}
+
+			IOLog ("BenchmarkStreamingClip: %-7s %2u-bit %s stores: mix %5u.%02u cycles/sample, clip %3u.%02u cycles/sample\n",
+					GetClipRoutineTierName (GetClipRoutineTier ()), (unsigned int)width, streaming ? "streaming" : "ordinary ",
+					(unsigned int)(mixCycles / ((UInt64)kRounds * kMixSamples)), (unsigned int)((mixCycles * 100 / ((UInt64)kRounds * kMixSamples)) % 100),
+					(unsigned int)(clipCycles / ((UInt64)kRounds * kFramesPerRound * kChannels)), (unsigned int)((clipCycles * 100 / ((UInt64)kRounds * kFramesPerRound * kChannels)) % 100));
+		}
+	}
+
+Exit:
+	sStreamingClipMinBytes = savedMinBytes;
+	if (NULL != ring)
+	{
+		IOFreeAligned (ring, kRingBytes);
+	}
+	if (NULL != mixDest)
+	{
+		IOFreeAligned (mixDest, kMixSamples * sizeof (Float32));
+	}
+	if (NULL != mixSource)
+	{
+		IOFreeAligned (mixSource, kMixSamples * sizeof (Float32));
+	}
+}
+
+//	Times clipAudioToOutputStream and convertFromAudioInputStream_NoWrap, and their dithered and planar versions, for
+//	every tier, sample width, channel count and buffer size, and logs ns/sample, GB/s (float and integer bytes moved) and
+//	cycles/sample. The routines are called through the public entry points so that a PPC build measures its own assembly
+//	routines as the baseline.
+void BenchmarkClipRoutines (void)
+{
+	static const UInt32		kWidths[] = { 8, 16, 20, 24, 32 };
+	static const UInt32		kChannels[] = { 2, 4, 8, 16 };
+	static const char *		kPasses[] = { "clip", "convert", "tpdf", "shaped", "p-clip", "p-conv" };
+	const UInt32			kMinFrames = 32;
+	const UInt32			kMaxFrames = 4096;
+	const UInt32			kMaxChannels = 16;
+	const UInt32			kSamplesPerMeasurement = 1 << 18;
+	Float32 *				mixBuf = NULL;
+	Float32 *				mixPlanes[kMaxChannels];
+	Float32 *				convertBuf = NULL;
+	Float32 *				convertPlanes[kMaxChannels];
+	void *					sampleBuf = NULL;
+	IOAudioStreamFormat		format;
+	ClipDitherState			ditherState;
+	UInt32					savedTier = GetClipRoutineTier ();
+	UInt32					seed = 1;
+
+	mixBuf = (Float32 *)IOMallocAligned (kMaxFrames * kMaxChannels * sizeof (Float32), 64);
+	FailIf (NULL == mixBuf, Exit);
+	// The convert passes write here, so the clip passes keep timing out of range samples.
+	convertBuf = (Float32 *)IOMallocAligned (kMaxFrames * kMaxChannels * sizeof (Float32), 64);
+	FailIf (NULL == convertBuf, Exit);
+	sampleBuf = IOMallocAligned (kMaxFrames * kMaxChannels * sizeof (SInt32), 64);
+	FailIf (NULL == sampleBuf, Exit);
+
+	// Roughly uniform samples in [-1.125, 1.125) so that both clip paths are exercised.
+	for (UInt32 i = 0; i < kMaxFrames * kMaxChannels; i++)
+	{
+		seed = seed * 1664525 + 1013904223;
+		mixBuf[i] = (Float32)(SInt32)seed * (1.125f / 2147483648.0f);
+	}
+	bzero (sampleBuf, kMaxFrames * kMaxChannels * sizeof (SInt32));
+	// The planar passes see the same samples as one kMaxFrames long plane per channel.
+	for (UInt32 channel = 0; channel < kMaxChannels; channel++)
+	{
+		mixPlanes[channel] = mixBuf + (channel * kMaxFrames);
+		convertPlanes[channel] = convertBuf + (channel * kMaxFrames);
+	}
+	bzero (&format, sizeof (format));
+
+	for (UInt32 tier = kClipRoutineTierScalar; tier < kClipRoutineTierCount; tier++)
+	{
+		// Skips the tiers this processor can't run.
+		if (SetClipRoutineTier (tier) != tier)
+		{
+			continue;
+		}
+		for (UInt32 widthIndex = 0; widthIndex < sizeof (kWidths) / sizeof (kWidths[0]); widthIndex++)
+		{
+			UInt32	bytesPerSample = (kWidths[widthIndex] + 7) / 8;
+
+			format.fBitWidth = kWidths[widthIndex];
+			format.fBitDepth = kWidths[widthIndex];
+			for (UInt32 channelIndex = 0; channelIndex < sizeof (kChannels) / sizeof (kChannels[0]); channelIndex++)
+			{
+				format.fNumChannels = kChannels[channelIndex];
+				for (UInt32 frames = kMinFrames; frames <= kMaxFrames; frames <<= 1)
+				{
+					UInt32	samples = frames * kChannels[channelIndex];
+					UInt32	iterations = (kSamplesPerMeasurement + samples - 1) / samples;
+
+					// Passes: clip, convert, clip with each dither mode, which should cost about the same as the plain clip, and
+					// the planar clip and convert, which should cost about the same as the interleaved ones.
+					for (UInt32 direction = 0; direction < sizeof (kPasses) / sizeof (kPasses[0]); direction++)
+					{
+						UInt64	startTime;
+						UInt64	endTime;
+						UInt64	startCycles;
+						UInt64	endCycles;
+						UInt64	nanos;
+						UInt64	totalSamples = (UInt64)iterations * samples;
+
+						InitClipDitherState (&ditherState, ((2 == direction) || (3 == direction)) ? direction - 1 : kClipDitherNone);
+						clock_get_uptime (&startTime);
+						startCycles = ReadCycleCounter ();
+						for (UInt32 i = 0; i < iterations; i++)
+						{
+							if (1 == direction)
+							{
+								convertFromAudioInputStream_NoWrap (sampleBuf, convertBuf, 0, frames, &format);
+							}
+							else if (4 == direction)
+							{
+								clipPlanarAudioToOutputStream (mixPlanes, sampleBuf, 0, frames, &format);
+							}
+							else if (5 == direction)
+							{
+								convertFromAudioInputStreamToPlanar_NoWrap (sampleBuf, convertPlanes, 0, frames, &format);
+							}
+							else
+							{
+								clipAudioToOutputStreamWithDither (mixBuf, sampleBuf, 0, frames, &format, &ditherState);
+							}
+						}
+						endCycles = ReadCycleCounter ();
+						clock_get_uptime (&endTime);
+						absolutetime_to_nanoseconds (endTime - startTime, &nanos);
+						if (0 == nanos)
+						{
+							nanos = 1;
+						}
+
+						// The kernel can't print floating point, so everything is logged in thousandths (hundredths for cycles).
+						UInt64	picosPerSample = nanos * 1000 / totalSamples;
+						UInt64	megabytesPerSecond = totalSamples * (sizeof (Float32) + bytesPerSample) * 1000 / nanos;
+						UInt64	centiCyclesPerSample = (endCycles - startCycles) * 100 / totalSamples;
+
+						IOLog ("BenchmarkClipRoutines: %-7s %-7s %2u-bit %2u ch %4u frames: %3u.%03u ns/sample, %3u.%03u GB/s, %3u.%02u cycles/sample\n",
+								GetClipRoutineTierName (tier), kPasses[direction], (unsigned int)kWidths[widthIndex],
+								(unsigned int)kChannels[channelIndex], (unsigned int)frames,
+								(unsigned int)(picosPerSample / 1000), (unsigned int)(picosPerSample % 1000),
+								(unsigned int)(megabytesPerSecond / 1000), (unsigned int)(megabytesPerSecond % 1000),
+								(unsigned int)(centiCyclesPerSample / 100), (unsigned int)(centiCyclesPerSample % 100));
+					}
+				}
+			}
+		}
+	}
+
+	BenchmarkStreamingClip ();
+
+Exit:
+	SetClipRoutineTier (savedTier);
+	if (NULL != sampleBuf)
+	{
+		IOFreeAligned (sampleBuf, kMaxFrames * kMaxChannels * sizeof (SInt32));
+	}
+	if (NULL != convertBuf)
+	{
+		IOFreeAligned (convertBuf, kMaxFrames * kMaxChannels * sizeof (Float32));
+	}
+	if (NULL != mixBuf)
+	{
+		IOFreeAligned (mixBuf, kMaxFrames * kMaxChannels * sizeof (Float32));
+	}
+}
+#endif
+
+//	Streams that carry IEEE754 Float32 already hold samples in the mix format, so their clip and conversion are a copy.
+static inline bool IsFloat32Format (const IOAudioStreamFormat * streamFormat)
+{
+	return (kIOAudioStreamNumericRepresentationIEEE754Float == streamFormat->fNumericRepresentation) && (32 == streamFormat->fBitWidth);
+}
+
+static IOReturn CopyFloat32ToOutputStream (const void *mixBuf, void *sampleBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat)
+{
+	UInt32			theFirstSample	= firstSampleFrame * streamFormat->fNumChannels;
+	const Float32 *	theMixBuffer	= ((const Float32 *)mixBuf) + theFirstSample;
+	Float32 *		theOutputBuffer	= ((Float32 *)sampleBuf) + theFirstSample;
+
+	// Nothing to do if the family mixes straight into the sample buffer.
+	if (theOutputBuffer != theMixBuffer)
+	{
+		memcpy (theOutputBuffer, theMixBuffer, numSampleFrames * streamFormat->fNumChannels * sizeof (Float32));
+	}
+
+	return kIOReturnSuccess;
+}
+
+static IOReturn CopyFloat32FromInputStream (const void *sampleBuf, void *destBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat)
+{
+	const Float32 *	theInputBuffer	= ((const Float32 *)sampleBuf) + (firstSampleFrame * streamFormat->fNumChannels);
+
+	if (theInputBuffer != destBuf)
+	{
+		memcpy (destBuf, theInputBuffer, numSampleFrames * streamFormat->fNumChannels * sizeof (Float32));
+	}
+
+	return kIOReturnSuccess;
+}
+
+IOReturn clipAudioToOutputStream(const void* mixBuf, void* sampleBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat)
+{
+    if(!streamFormat)
+	{
+        return kIOReturnBadArgument;
+    }
+	if (IsFloat32Format (streamFormat))
+	{
+		return CopyFloat32ToOutputStream (mixBuf, sampleBuf, firstSampleFrame, numSampleFrames, streamFormat);
+	}
+	
+	UInt32		theNumberSamples	= numSampleFrames * streamFormat->fNumChannels;
+	UInt32		theFirstSample		= firstSampleFrame * streamFormat->fNumChannels;
+	Float32*	theMixBuffer		= ((Float32*)mixBuf) + theFirstSample;
+
+	// aml, added optimized routines [3034710]
+	switch(streamFormat->fBitWidth)
+	{
+		case 8:
+			{
+				SInt8* theOutputBufferSInt8 = ((SInt8*)sampleBuf) + theFirstSample;
+				#if	defined(__ppc__)
+					Float32ToInt8(theMixBuffer, theOutputBufferSInt8, theNumberSamples);
+				#elif defined (__i386__) || defined(__x86_64__)
+					GetClipSampleRoutine (kSampleWidth8, theNumberSamples)(theMixBuffer, theOutputBufferSInt8, theNumberSamples);
+				#endif	
+				//ClipFloat32ToSInt8_4(theMixBuffer, theOutputBufferSInt8, theNumberSamples);
+			}
+			break;
+
+		case 16:
+			{
+				SInt16* theOutputBufferSInt16 = ((SInt16*)sampleBuf) + theFirstSample;
+
+				#if	defined(__ppc__)
+					Float32ToSwapInt16(theMixBuffer, theOutputBufferSInt16, theNumberSamples);
+				#elif defined(__i386__) || defined(__x86_64__)
+					GetClipSampleRoutine (kSampleWidth16, theNumberSamples * 2)(theMixBuffer, theOutputBufferSInt16, theNumberSamples);
+				#endif	
+				//ClipFloat32ToSInt16LE_4(theMixBuffer, theOutputBufferSInt16, theNumberSamples);
+			}
+			break;
+
+		case 20:
+		case 24:
+			{
+				SInt32* theOutputBufferSInt24 = (SInt32*)(((UInt8*)sampleBuf) + (theFirstSample * 3));
+
+				#if	defined(__ppc__)
+					Float32ToSwapInt24(theMixBuffer, theOutputBufferSInt24, theNumberSamples);
+				#elif defined(__i386__) || defined(__x86_64__)
+					GetClipSampleRoutine (kSampleWidth24, theNumberSamples * 3)(theMixBuffer, theOutputBufferSInt24, theNumberSamples);
+				#endif	
+				//ClipFloat32ToSInt24LE_4(theMixBuffer, theOutputBufferSInt24, theNumberSamples);
+			}
+			break;
+
+		case 32:
+			{
+				SInt32* theOutputBufferSInt32 = ((SInt32*)sampleBuf) + theFirstSample;
+
+				#if	defined(__ppc__)
+					Float32ToSwapInt32(theMixBuffer, theOutputBufferSInt32, theNumberSamples);
+				#elif defined(__i386__) || defined(__x86_64__)
+					GetClipSampleRoutine (kSampleWidth32, theNumberSamples * 4)(theMixBuffer, theOutputBufferSInt32, theNumberSamples);
+				#endif	
+				//ClipFloat32ToSInt32LE_4(theMixBuffer, theOutputBufferSInt32, theNumberSamples);
+			}
+			break;
+	};
+		
+	return kIOReturnSuccess;
+}
+
+void InitClipDitherState (ClipDitherState * ditherState, UInt32 mode)
+{
+	bzero (ditherState, sizeof (ClipDitherState));
+	ditherState->mode = mode;
+	// xorshift must not start from zero; give every lane its own sequence.
+	for (UInt32 lane = 0; lane < 8; lane++)
+	{
+		ditherState->seed[lane] = 0x9E3779B9 * (lane + 1);
+	}
+}
+
+//	Same as clipAudioToOutputStream, but quantizes with TPDF dither (and optionally first order noise shaping) to the
+//	stream's bit depth. Bit depths above 24 gain nothing from dither against a Float32 source and are clipped as usual.
+IOReturn clipAudioToOutputStreamWithDither(const void* mixBuf, void* sampleBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat, ClipDitherState * ditherState)
+{
+	UInt32		theBitWidth;
+	UInt32		theBitDepth;
+
+	if(!streamFormat)
+	{
+		return kIOReturnBadArgument;
+	}
+
+	theBitWidth = (20 == streamFormat->fBitWidth) ? 24 : streamFormat->fBitWidth;
+	theBitDepth = streamFormat->fBitDepth;
+	if ((0 == theBitDepth) || (theBitDepth > theBitWidth))
+	{
+		theBitDepth = theBitWidth;
+	}
+	if (		(NULL == ditherState)
+			||	(kClipDitherNone == ditherState->mode)
+			||	IsFloat32Format (streamFormat)
+			||	(theBitDepth < 8)
+			||	(theBitDepth > 24)
+			||	((8 != theBitWidth) && (16 != theBitWidth) && (24 != theBitWidth) && (32 != theBitWidth)))
+	{
+		return clipAudioToOutputStream (mixBuf, sampleBuf, firstSampleFrame, numSampleFrames, streamFormat);
+	}
+
+	sDitherRoutine (((const Float32 *)mixBuf) + (firstSampleFrame * streamFormat->fNumChannels),
+					((UInt8 *)sampleBuf) + (firstSampleFrame * streamFormat->fNumChannels * (theBitWidth / 8)),
+					numSampleFrames * streamFormat->fNumChannels, streamFormat->fNumChannels, theBitWidth, theBitDepth, ditherState);
+
+	return kIOReturnSuccess;
+}
+
+void InitClipMeterState (ClipMeterState * meterState, UInt32 numChannels)
+{
+	bzero (meterState, sizeof (ClipMeterState));
+	meterState->numChannels = (numChannels <= kClipMeterMaxChannels) ? numChannels : 0;
+}
+
+//	Adds numSampleFrames frames of samples (the Float32 side of a clip or convert call) to the meters. The levels are
+//	accumulated locally and then published under the sequence counter. There is one writer per stream; should a second
+//	one show up while the meters are being published, its block is dropped rather than waited for.
+void MeterClipSamples (const Float32 *samples, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat, ClipMeterState *meterState)
+{
+	Float32		thePeak[kClipMeterMaxChannels];
+	Float64		theSumOfSquares[kClipMeterMaxChannels];
+	UInt32		theClipCount[kClipMeterMaxChannels];
+	Float32		theClipThreshold;
+	UInt32		theNumChannels;
+	UInt32		theSequence;
+
+	if ((NULL == streamFormat) || (NULL == meterState) || (0 == meterState->numChannels) || (streamFormat->fNumChannels != meterState->numChannels))
+	{
+		return;
+	}
+
+	// The largest magnitude the sample width represents; anything at or above it was (or will be) clipped.
+	switch (streamFormat->fBitWidth)
+	{
+		case 8:		theClipThreshold = (Float32)kMaxClipSInt8;		break;
+		case 16:	theClipThreshold = (Float32)kMaxClipSInt16;		break;
+		case 20:
+		case 24:	theClipThreshold = (Float32)kMaxClipSInt24;		break;
+		default:	theClipThreshold = (Float32)kMaxClipSInt32;		break;
+	}
+
+	theNumChannels = meterState->numChannels;
+	bzero (thePeak, theNumChannels * sizeof (Float32));
+	bzero (theSumOfSquares, theNumChannels * sizeof (Float64));
+	bzero (theClipCount, theNumChannels * sizeof (UInt32));
+	sMeterRoutine (samples, numSampleFrames, theNumChannels, theClipThreshold, thePeak, theSumOfSquares, theClipCount);
+
+	theSequence = meterState->sequence;
+	if ((theSequence & 1) || !OSCompareAndSwap (theSequence, theSequence + 1, &meterState->sequence))
+	{
+		return;
+	}
+
+	if (meterState->resetRequested)
+	{
+		meterState->resetRequested = 0;
+		meterState->sampleFrames = 0;
+		bzero (meterState->peak, sizeof (meterState->peak));
+		bzero (meterState->sumOfSquares, sizeof (meterState->sumOfSquares));
+		bzero (meterState->clipCount, sizeof (meterState->clipCount));
+	}
+	meterState->sampleFrames += numSampleFrames;
+	for (UInt32 channel = 0; channel < theNumChannels; channel++)
+	{
+		if (thePeak[channel] > meterState->peak[channel])
+		{
+			meterState->peak[channel] = thePeak[channel];
+		}
+		meterState->sumOfSquares[channel] += theSumOfSquares[channel];
+		meterState->clipCount[channel] += theClipCount[channel];
+	}
+
+	OSMemoryBarrier ();
+	meterState->sequence = theSequence + 2;
+}
+
+//	Copies a consistent set of meters, retrying while the writer is in the middle of an update. With reset, the meters
+//	start over with the next block the writer adds.
+void GetClipMeterSnapshot (ClipMeterState *meterState, ClipMeterState *snapshot, bool reset)
+{
+	UInt32		theSequence;
+
+	do
+	{
+		theSequence = meterState->sequence;
+		OSMemoryBarrier ();
+		memcpy (snapshot, (const void *)meterState, sizeof (ClipMeterState));
+		OSMemoryBarrier ();
+	} while ((theSequence & 1) || (theSequence != meterState->sequence));
+
+	if (reset)
+	{
+		meterState->resetRequested = 1;
+	}
+}
+
+IOReturn convertFromAudioInputStream_NoWrap (const void *sampleBuf,
+												void *destBuf,
+												UInt32 firstSampleFrame,
+												UInt32 numSampleFrames,
+												const IOAudioStreamFormat *streamFormat) {
+	UInt32	numSamplesLeft;
+	float 	*floatDestBuf;
+
+	if (IsFloat32Format (streamFormat))
+	{
+		return CopyFloat32FromInputStream (sampleBuf, destBuf, firstSampleFrame, numSampleFrames, streamFormat);
+	}
+
+    floatDestBuf = (float *)destBuf;
+	numSamplesLeft = numSampleFrames * streamFormat->fNumChannels;
+
+	//	debugIOLog ("destBuf = %p, firstSampleFrame = %ld, numSampleFrames = %ld", destBuf, firstSampleFrame, numSampleFrames);
+
+	switch (streamFormat->fBitWidth) 
+	{
+		case 8:
+			SInt8 *inputBuf8;
+
+			inputBuf8 = &(((SInt8 *)sampleBuf)[firstSampleFrame * streamFormat->fNumChannels]);
+			#if defined(__ppc__)
+				Int8ToFloat32(inputBuf8, floatDestBuf, numSamplesLeft);
+			#elif defined(__i386__) || defined(__x86_64__)
+				sSampleRoutines[kSampleDirectionInput][kSampleWidth8](inputBuf8, floatDestBuf, numSamplesLeft);
+			#endif
+
+			break;
+		case 16:
+			SInt16 *inputBuf16;
+			
+			inputBuf16 = &(((SInt16 *)sampleBuf)[firstSampleFrame * streamFormat->fNumChannels]);
+
+			#if defined(__ppc__)
+				SwapInt16ToFloat32(inputBuf16, floatDestBuf, numSamplesLeft, 16);
+			#elif defined(__i386__) || defined(__x86_64__)
+				sSampleRoutines[kSampleDirectionInput][kSampleWidth16](inputBuf16, floatDestBuf, numSamplesLeft);
+			#endif
+
+			break;
+		case 20:
+		case 24:
+			register SInt8 *inputBuf24;
+
+			// Multiply by 3 because 20 and 24 bit samples are packed into only three bytes, so we have to index bytes, not shorts or longs
+			inputBuf24 = &(((SInt8 *)sampleBuf)[firstSampleFrame * streamFormat->fNumChannels * 3]);
+
+			#if defined(__ppc__)
+				SwapInt24ToFloat32((long *)inputBuf24, floatDestBuf, numSamplesLeft, 24);
+			#elif defined(__i386__) || defined(__x86_64__)
+				sSampleRoutines[kSampleDirectionInput][kSampleWidth24](inputBuf24, floatDestBuf, numSamplesLeft);
+			#endif
+
+			break;
+		case 32:
+			register SInt32 *inputBuf32;
+			inputBuf32 = &(((SInt32 *)sampleBuf)[firstSampleFrame * streamFormat->fNumChannels]);
+
+			#if defined(__ppc__)
+				SwapInt32ToFloat32(inputBuf32, floatDestBuf, numSamplesLeft, 32);
+			#elif defined(__i386__) || defined(__x86_64__)
+				sSampleRoutines[kSampleDirectionInput][kSampleWidth32](inputBuf32, floatDestBuf, numSamplesLeft);
+			#endif
+
+			break;
 	}
 
     return kIOReturnSuccess;
 }
 
+//	Samples on each side of the wrap that are converted together from a small contiguous copy, so that the vector loops
+//	of every tier run across the wrap instead of leaving a scalar tail on each segment.
+#define	kWrapStitchSamples			32
+
+//	Same as convertFromAudioInputStream_NoWrap, but sampleBuf is a ring of sampleBufFrames frames and the range may run
+//	past its end and continue at its start.
+IOReturn convertFromAudioInputStream (const void *sampleBuf,
+										UInt32 sampleBufFrames,
+										void *destBuf,
+										UInt32 firstSampleFrame,
+										UInt32 numSampleFrames,
+										const IOAudioStreamFormat *streamFormat)
+{
+	UInt32		theFirstFrames;
+
+	if ((NULL == streamFormat) || (firstSampleFrame >= sampleBufFrames) || (numSampleFrames > sampleBufFrames))
+	{
+		return kIOReturnBadArgument;
+	}
+
+	theFirstFrames = sampleBufFrames - firstSampleFrame;
+	if (numSampleFrames <= theFirstFrames)
+	{
+		return convertFromAudioInputStream_NoWrap (sampleBuf, destBuf, firstSampleFrame, numSampleFrames, streamFormat);
+	}
+
+	// A Float32 copy has no vector loop to keep going across the wrap.
+	if (IsFloat32Format (streamFormat))
+	{
+		CopyFloat32FromInputStream (sampleBuf, destBuf, firstSampleFrame, theFirstFrames, streamFormat);
+		return CopyFloat32FromInputStream (sampleBuf, ((Float32 *)destBuf) + (theFirstFrames * streamFormat->fNumChannels), 0, numSampleFrames - theFirstFrames, streamFormat);
+	}
+
+#if defined(__i386__) || defined(__x86_64__)
+	UInt8			theStitch[kWrapStitchSamples * sizeof (SInt32)];
+	SampleRoutine	theRoutine;
+	UInt32			theBytesPerSample;
+	UInt32			theFirstSamples		= theFirstFrames * streamFormat->fNumChannels;
+	UInt32			theSecondSamples	= (numSampleFrames - theFirstFrames) * streamFormat->fNumChannels;
+	UInt32			theDirectSamples;
+	UInt32			theStitchSamples	= 0;
+	const UInt8 *	theSource;
+	Float32 *		theDest				= (Float32 *)destBuf;
+
+	switch (streamFormat->fBitWidth)
+	{
+		case 8:		theRoutine = sSampleRoutines[kSampleDirectionInput][kSampleWidth8];		break;
+		case 16:	theRoutine = sSampleRoutines[kSampleDirectionInput][kSampleWidth16];	break;
+		case 20:
+		case 24:	theRoutine = sSampleRoutines[kSampleDirectionInput][kSampleWidth24];	break;
+		case 32:	theRoutine = sSampleRoutines[kSampleDirectionInput][kSampleWidth32];	break;
+		default:	return kIOReturnSuccess;
+	}
+	theBytesPerSample = (streamFormat->fBitWidth + 7) / 8;
+	theSource = ((const UInt8 *)sampleBuf) + (firstSampleFrame * streamFormat->fNumChannels * theBytesPerSample);
+
+	// Up to the last whole stitch block before the end of the ring.
+	theDirectSamples = theFirstSamples - (theFirstSamples % kWrapStitchSamples);
+	theRoutine (theSource, theDest, theDirectSamples);
+
+	// The rest of the first segment and enough of the second one to fill a stitch block.
+	if (theFirstSamples > theDirectSamples)
+	{
+		UInt32	theTailSamples = theFirstSamples - theDirectSamples;
+
+		theStitchSamples = kWrapStitchSamples - theTailSamples;
+		if (theStitchSamples > theSecondSamples)
+		{
+			theStitchSamples = theSecondSamples;
+		}
+		memcpy (theStitch, theSource + (theDirectSamples * theBytesPerSample), theTailSamples * theBytesPerSample);
+		memcpy (theStitch + (theTailSamples * theBytesPerSample), sampleBuf, theStitchSamples * theBytesPerSample);
+		theRoutine (theStitch, theDest + theDirectSamples, theTailSamples + theStitchSamples);
+	}
+
+	// The remainder of the second segment, from the start of the ring.
+	theRoutine (((const UInt8 *)sampleBuf) + (theStitchSamples * theBytesPerSample), theDest + theFirstSamples + theStitchSamples, theSecondSamples - theStitchSamples);
+
+	return kIOReturnSuccess;
+#else
+	convertFromAudioInputStream_NoWrap (sampleBuf, destBuf, firstSampleFrame, theFirstFrames, streamFormat);
+	return convertFromAudioInputStream_NoWrap (sampleBuf, ((Float32 *)destBuf) + (theFirstFrames * streamFormat->fNumChannels), 0, numSampleFrames - theFirstFrames, streamFormat);
+#endif
+}
+
+//	Planar clients whose format has no fused routine, and routed streams, go through a small interleaved scratch buffer,
+//	which stays in the cache, and the regular routines of the current tier.
+#define	kScratchSamples				256
+
+static bool HasFusedPlanarRoutine (const IOAudioStreamFormat * streamFormat)
+{
+	return		((20 == streamFormat->fBitWidth) || (24 == streamFormat->fBitWidth))
+			&&	((2 == streamFormat->fNumChannels) || (0 == (streamFormat->fNumChannels % 4)));
+}
+
+//	Same as clipAudioToOutputStream, but the mix comes from one buffer per channel (mixPlanes[channel], indexed by sample
+//	frame like mixBuf) and is interleaved into sampleBuf as it is clipped.
+IOReturn clipPlanarAudioToOutputStream (const Float32 * const *mixPlanes,
+										void *sampleBuf,
+										UInt32 firstSampleFrame,
+										UInt32 numSampleFrames,
+										const IOAudioStreamFormat *streamFormat)
+{
+	Float32		theScratch[kScratchSamples];
+	UInt32		theNumChannels;
+	UInt32		theFrameBytes;
+	UInt32		theChunkFrames;
+
+	if ((NULL == mixPlanes) || (NULL == streamFormat) || (0 == streamFormat->fNumChannels) || (streamFormat->fNumChannels > kScratchSamples))
+	{
+		return kIOReturnBadArgument;
+	}
+
+	theNumChannels = streamFormat->fNumChannels;
+	theFrameBytes = theNumChannels * ((streamFormat->fBitWidth + 7) / 8);
+
+#if defined(__i386__) || defined(__x86_64__)
+	if ((NULL != sPlanarClipRoutine) && HasFusedPlanarRoutine (streamFormat))
+	{
+		sPlanarClipRoutine (mixPlanes, firstSampleFrame, ((UInt8 *)sampleBuf) + (firstSampleFrame * theFrameBytes), numSampleFrames, theNumChannels);
+		return kIOReturnSuccess;
+	}
+#endif
+
+	theChunkFrames = kScratchSamples / theNumChannels;
+	while (numSampleFrames > 0)
+	{
+		UInt32	theFrames = (numSampleFrames < theChunkFrames) ? numSampleFrames : theChunkFrames;
+
+		for (UInt32 frame = 0; frame < theFrames; frame++)
+		{
+			for (UInt32 channel = 0; channel < theNumChannels; channel++)
+			{
+				theScratch[(frame * theNumChannels) + channel] = mixPlanes[channel][firstSampleFrame + frame];
+			}
+		}
+		clipAudioToOutputStream (theScratch, ((UInt8 *)sampleBuf) + (firstSampleFrame * theFrameBytes), 0, theFrames, streamFormat);
+		firstSampleFrame += theFrames;
+		numSampleFrames -= theFrames;
+	}
+
+	return kIOReturnSuccess;
+}
+
+//	Same as convertFromAudioInputStream_NoWrap, but the samples are split into one buffer per channel as they are
+//	converted. Frame firstSampleFrame of sampleBuf lands at index 0 of every plane.
+IOReturn convertFromAudioInputStreamToPlanar_NoWrap (const void *sampleBuf,
+														Float32 * const *destPlanes,
+														UInt32 firstSampleFrame,
+														UInt32 numSampleFrames,
+														const IOAudioStreamFormat *streamFormat)
+{
+	Float32		theScratch[kScratchSamples];
+	UInt32		theNumChannels;
+	UInt32		theChunkFrames;
+	UInt32		theDestFrame = 0;
+
+	if ((NULL == destPlanes) || (NULL == streamFormat) || (0 == streamFormat->fNumChannels) || (streamFormat->fNumChannels > kScratchSamples))
+	{
+		return kIOReturnBadArgument;
+	}
+
+	theNumChannels = streamFormat->fNumChannels;
+
+#if defined(__i386__) || defined(__x86_64__)
+	if ((NULL != sPlanarConvertRoutine) && HasFusedPlanarRoutine (streamFormat))
+	{
+		sPlanarConvertRoutine (((const UInt8 *)sampleBuf) + (firstSampleFrame * theNumChannels * 3), destPlanes, numSampleFrames, theNumChannels);
+		return kIOReturnSuccess;
+	}
+#endif
+
+	theChunkFrames = kScratchSamples / theNumChannels;
+	while (numSampleFrames > 0)
+	{
+		UInt32	theFrames = (numSampleFrames < theChunkFrames) ? numSampleFrames : theChunkFrames;
+
+		convertFromAudioInputStream_NoWrap (sampleBuf, theScratch, firstSampleFrame, theFrames, streamFormat);
+		for (UInt32 frame = 0; frame < theFrames; frame++)
+		{
+			for (UInt32 channel = 0; channel < theNumChannels; channel++)
+			{
+				destPlanes[channel][theDestFrame + frame] = theScratch[(frame * theNumChannels) + channel];
+			}
+		}
+		firstSampleFrame += theFrames;
+		theDestFrame += theFrames;
+		numSampleFrames -= theFrames;
+	}
+
+	return kIOReturnSuccess;
+}
+
+//	Same as clipAudioToOutputStreamWithDither (pass NULL for ditherState to just clip), but channel d of sampleBuf is fed
+//	by channel channelMap[d] of mixBuf, or silenced if that is not a valid channel. The routing is not done inside the
+//	tier kernels: each chunk of routed frames is first gathered into a kScratchSamples float scratch buffer on the stack,
+//	where a silenced channel is a zero store, and the scratch buffer then goes through the usual clip. That is one extra
+//	load and store per sample, but only while a channel map is set.
+IOReturn clipRoutedAudioToOutputStream (const void *mixBuf,
+										void *sampleBuf,
+										UInt32 firstSampleFrame,
+										UInt32 numSampleFrames,
+										const IOAudioStreamFormat *streamFormat,
+										const UInt8 *channelMap,
+										ClipDitherState *ditherState)
+{
+	Float32		theScratch[kScratchSamples];
+	UInt32		theNumChannels;
+	UInt32		theFrameBytes;
+	UInt32		theChunkFrames;
+
+	if ((NULL == channelMap) || (NULL == streamFormat) || (0 == streamFormat->fNumChannels) || (streamFormat->fNumChannels > kClipMaxRoutedChannels))
+	{
+		return kIOReturnBadArgument;
+	}
+
+	theNumChannels = streamFormat->fNumChannels;
+	theFrameBytes = theNumChannels * ((streamFormat->fBitWidth + 7) / 8);
+	theChunkFrames = kScratchSamples / theNumChannels;
+	while (numSampleFrames > 0)
+	{
+		UInt32	theFrames = (numSampleFrames < theChunkFrames) ? numSampleFrames : theChunkFrames;
+
+		for (UInt32 frame = 0; frame < theFrames; frame++)
+		{
+			const Float32 *	theSource = ((const Float32 *)mixBuf) + ((firstSampleFrame + frame) * theNumChannels);
+			Float32 *		theDest = theScratch + (frame * theNumChannels);
+
+			for (UInt32 channel = 0; channel < theNumChannels; channel++)
+			{
+				theDest[channel] = (channelMap[channel] < theNumChannels) ? theSource[channelMap[channel]] : 0.0f;
+			}
+		}
+		clipAudioToOutputStreamWithDither (theScratch, ((UInt8 *)sampleBuf) + (firstSampleFrame * theFrameBytes), 0, theFrames, streamFormat, ditherState);
+		firstSampleFrame += theFrames;
+		numSampleFrames -= theFrames;
+	}
+
+	return kIOReturnSuccess;
+}
+
+//	Same as convertFromAudioInputStream_NoWrap, but channel d of destBuf is fed by channel channelMap[d] of sampleBuf, or
+//	silenced if that is not a valid channel. Each chunk is converted into the scratch buffer as usual and then scattered
+//	into destBuf through the map, so this too costs one extra load and store per sample.
+IOReturn convertFromAudioInputStreamRouted_NoWrap (const void *sampleBuf,
+													void *destBuf,
+													UInt32 firstSampleFrame,
+													UInt32 numSampleFrames,
+													const IOAudioStreamFormat *streamFormat,
+													const UInt8 *channelMap)
+{
+	Float32		theScratch[kScratchSamples];
+	Float32 *	theDest = (Float32 *)destBuf;
+	UInt32		theNumChannels;
+	UInt32		theChunkFrames;
+
+	if ((NULL == channelMap) || (NULL == streamFormat) || (0 == streamFormat->fNumChannels) || (streamFormat->fNumChannels > kClipMaxRoutedChannels))
+	{
+		return kIOReturnBadArgument;
+	}
+
+	theNumChannels = streamFormat->fNumChannels;
+	theChunkFrames = kScratchSamples / theNumChannels;
+	while (numSampleFrames > 0)
+	{
+		UInt32	theFrames = (numSampleFrames < theChunkFrames) ? numSampleFrames : theChunkFrames;
+
+		convertFromAudioInputStream_NoWrap (sampleBuf, theScratch, firstSampleFrame, theFrames, streamFormat);
+		for (UInt32 frame = 0; frame < theFrames; frame++)
+		{
+			const Float32 *	theSource = theScratch + (frame * theNumChannels);
+
+			for (UInt32 channel = 0; channel < theNumChannels; channel++)
+			{
+				theDest[channel] = (channelMap[channel] < theNumChannels) ? theSource[channelMap[channel]] : 0.0f;
+			}
+			theDest += theNumChannels;
+		}
+		firstSampleFrame += theFrames;
+		numSampleFrames -= theFrames;
+	}
+
+	return kIOReturnSuccess;
+}
+
 }
 
 // aml new routines [3034710]
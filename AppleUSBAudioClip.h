@@ -33,6 +33,27 @@ typedef double				Float64;
 
 UInt32 CalculateOffset (UInt64 nanoseconds, UInt32 sampleRate);
 
+//	Clip routine tiers, from slowest to fastest. Each tier uses the vector unit of its name where it has a kernel for the
+//	sample width, and the routines of the tier below it otherwise. The integer tier is outside that order: it clips and
+//	converts without touching the FPU and is only used when selected explicitly, where it benchmarks faster.
+enum
+{
+	kClipRoutineTierScalar			= 0,
+	kClipRoutineTierSSE2,
+	kClipRoutineTierSSSE3,
+	kClipRoutineTierAVX2,
+	kClipRoutineTierAVX512,
+	kClipRoutineTierInteger,
+	kClipRoutineTierCount
+};
+
+void			InitClipRoutines (void);
+UInt32			SetClipRoutineTier (UInt32 inTier);
+UInt32			GetClipRoutineTier (void);
+UInt32			GetMaxClipRoutineTier (void);
+const char *	GetClipRoutineTierName (UInt32 inTier);
+void			BenchmarkClipRoutines (void);
+
 IOReturn	clipAudioToOutputStream (const void *mixBuf,
 											void *sampleBuf,
 											UInt32 firstSampleFrame,
@@ -44,6 +65,94 @@ IOReturn	convertFromAudioInputStream_NoWrap (const void *sampleBuf,
 														UInt32 firstSampleFrame,
 														UInt32 numSampleFrames,
 														const IOAudioStreamFormat *streamFormat);
+
+//	convertFromAudioInputStream_NoWrap for a range that may wrap around the end of the sample buffer.
+IOReturn	convertFromAudioInputStream (const void *sampleBuf,
+											UInt32 sampleBufFrames,
+											void *destBuf,
+											UInt32 firstSampleFrame,
+											UInt32 numSampleFrames,
+											const IOAudioStreamFormat *streamFormat);
+
+//	Planar (one buffer per channel) versions of the routines above. The samples are interleaved or deinterleaved in the
+//	same pass as the clip or the conversion.
+IOReturn	clipPlanarAudioToOutputStream (const Float32 * const *mixPlanes,
+											void *sampleBuf,
+											UInt32 firstSampleFrame,
+											UInt32 numSampleFrames,
+											const IOAudioStreamFormat *streamFormat);
+
+IOReturn	convertFromAudioInputStreamToPlanar_NoWrap (const void *sampleBuf,
+														Float32 * const *destPlanes,
+														UInt32 firstSampleFrame,
+														UInt32 numSampleFrames,
+														const IOAudioStreamFormat *streamFormat);
+
+//	Dither modes for clipAudioToOutputStreamWithDither ().
+enum
+{
+	kClipDitherNone					= 0,
+	kClipDitherTPDF,				// triangular (+/- 1 LSB) dither
+	kClipDitherTPDFShaped			// triangular dither with first order error feedback noise shaping per channel
+};
+
+#define	kClipDitherMaxChannels		32
+
+//	Per stream dither state. Streams with more than kClipDitherMaxChannels channels get dither without noise shaping.
+typedef struct ClipDitherState
+{
+	UInt32			mode;
+	UInt32			seed[8];							// xorshift32 state, one per vector lane
+	Float32			error[kClipDitherMaxChannels];		// last quantization error of each channel, in LSBs
+} ClipDitherState;
+
+void		InitClipDitherState (ClipDitherState * ditherState, UInt32 mode);
+
+IOReturn	clipAudioToOutputStreamWithDither (const void *mixBuf,
+											void *sampleBuf,
+											UInt32 firstSampleFrame,
+											UInt32 numSampleFrames,
+											const IOAudioStreamFormat *streamFormat,
+											ClipDitherState *ditherState);
+
+//	Channel routing. Entry d of a channel map is the channel that feeds channel d of the destination (the device for
+//	output, the Float32 buffer for input), or kClipChannelSilent to silence it.
+#define	kClipChannelSilent			0xFF
+#define	kClipMaxRoutedChannels		32
+
+IOReturn	clipRoutedAudioToOutputStream (const void *mixBuf,
+											void *sampleBuf,
+											UInt32 firstSampleFrame,
+											UInt32 numSampleFrames,
+											const IOAudioStreamFormat *streamFormat,
+											const UInt8 *channelMap,
+											ClipDitherState *ditherState);
+
+IOReturn	convertFromAudioInputStreamRouted_NoWrap (const void *sampleBuf,
+														void *destBuf,
+														UInt32 firstSampleFrame,
+														UInt32 numSampleFrames,
+														const IOAudioStreamFormat *streamFormat,
+														const UInt8 *channelMap);
+
+//	Per channel level meters, accumulated over the Float32 side of the clip and convert calls. Readers take a snapshot
+//	with GetClipMeterSnapshot (); the writer makes sequence odd while it updates the values.
+#define	kClipMeterMaxChannels		32
+
+typedef struct ClipMeterState
+{
+	volatile UInt32	sequence;
+	volatile UInt32	resetRequested;
+	UInt32			numChannels;
+	UInt64			sampleFrames;							// frames accumulated since the last reset
+	Float32			peak[kClipMeterMaxChannels];			// largest absolute sample value
+	Float64			sumOfSquares[kClipMeterMaxChannels];	// RMS = sqrt (sumOfSquares / sampleFrames)
+	UInt32			clipCount[kClipMeterMaxChannels];		// samples at or beyond full scale
+} ClipMeterState;
+
+void		InitClipMeterState (ClipMeterState * meterState, UInt32 numChannels);
+void		MeterClipSamples (const Float32 *samples, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat, ClipMeterState *meterState);
+void		GetClipMeterSnapshot (ClipMeterState *meterState, ClipMeterState *snapshot, bool reset);
 }
 
 #endif
@@ -132,6 +132,46 @@
 #define DEBUGUHCI					FALSE
 #define DEBUGSAMPLERATEHANDLER		FALSE
 
+// FORCECLIPROUTINETIER makes InitClipRoutines select kForcedClipRoutineTier (see AppleUSBAudioClip.h) instead of the best tier the CPU supports, e.g. the integer tier on platforms where it benchmarks faster
+#define FORCECLIPROUTINETIER		FALSE
+#define kForcedClipRoutineTier		0
+
+// VERIFYCLIPROUTINES checks every clip and convert routine tier against the scalar routines when InitClipRoutines first runs and never selects a tier that differs
+#define VERIFYCLIPROUTINES			TRUE
+
+// BENCHMARKCLIPROUTINES times every clip and convert routine tier over all sample widths, a range of channel counts and buffer sizes when InitClipRoutines runs
+#define BENCHMARKCLIPROUTINES		FALSE
+
+// SIMULATEISOCFAULTS makes the isoc completions and the CoreAudio thread misbehave on purpose, from a fixed seed, so input glitches can be reproduced without a bad device or a busy bus. One in kSimulated*Rate packets (0 for none) is cut short, returns kIOReturnUnderrun or returns kIOReturnOverrun without a count, and one in kSimulatedJitterRate completions and conversions is held for up to kSimulatedMaxJitter us
+#define SIMULATEISOCFAULTS			FALSE
+#define kSimulatedFaultSeed			1
+#define kSimulatedShortPacketRate	64
+#define kSimulatedUnderrunRate		256
+#define kSimulatedOverrunRate		1024
+#define kSimulatedJitterRate		16
+#define kSimulatedMaxJitter			300
+
+// LOGISOCSTATISTICS logs, for every second of audio a stream moves, the CPU time its completions and conversions took and the glitches it saw
+#define LOGISOCSTATISTICS			FALSE
+
+// STRESSCOALESCENCEHANDOFF runs the readHandler and CoreAudio sides of the input handoff against each other on two threads, with a fake read buffer, whenever an input stream is configured, and logs every copy that saw a frame list being refilled
+#define STRESSCOALESCENCEHANDOFF	FALSE
+#define kStressCoalescenceIterations	1000000
+
+// DIRECTINPUTCONVERT lets convertInputSamples convert input the readHandler hasn't coalesced yet straight from the USB frame lists instead of copying it into the sample buffer first
+#define DIRECTINPUTCONVERT			TRUE
+
+// ADAPTIVEQUEUEDEPTH starts every stream with the latency profile's queue depth and takes a frame list off the queue each time the isoc completions have kept at least kQueueDepthGuardFrames USB frames of margin for kQueueDepthShrinkInterval ms, down to kMinimumFrameListsToQueue. A completion that comes in with less margin puts a frame list back at once and doubles the wait before the next try, up to kQueueDepthMaxHoldoff times
+#define ADAPTIVEQUEUEDEPTH			TRUE
+#define kQueueDepthShrinkInterval	1000
+#define kQueueDepthGuardFrames		2
+#define kQueueDepthMaxHoldoff		16
+#define kMinimumFrameListsToQueue	2
+
+// FEEDBACKPLL runs the values read from an asynchronous output's feedback endpoint through a critically damped second order loop with a time constant of 2^kFeedbackPLLTimeConstantShift USB frames, instead of stepping the packet sizes to each value as it arrives
+#define FEEDBACKPLL					TRUE
+#define kFeedbackPLLTimeConstantShift	10
+
 //  Default length of DJM03AudioDevice timer interval in milliseconds
 #define kRefreshInterval			128
 
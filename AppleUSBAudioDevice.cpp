@@ -189,6 +189,8 @@ bool DJM03AudioDevice::start (IOService * provider) {
 	FailIf (NULL == mControlInterface, Exit);		// <rdar://7085810>
 	FailIf (FALSE == mControlInterface->open (this), Exit);
 
+	InitClipRoutines ();
+
 	//  <rdar://problem/6686515>
 	mInitHardwareThread = thread_call_allocate ((thread_call_func_t)DJM03AudioDevice::initHardwareThread, (thread_call_param_t)this);
 	FailIf (NULL == mInitHardwareThread, Exit);
@@ -234,28 +234,66 @@ Exit:
 IOReturn DJM03AudioEngine::clipOutputSamples (const void *mixBuf, void *sampleBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat, IOAudioStream *audioStream) {
 	IOReturn				result;
 	DJM03AudioStream *		usbAudioStream;			
+	#if LOGISOCSTATISTICS
+	UInt64					startTime;
+
+	clock_get_uptime (&startTime);
+	#endif
 
 	result = kIOReturnError;
 	
 	usbAudioStream = OSDynamicCast ( DJM03AudioStream, audioStream );
 	FailIf ( NULL == usbAudioStream, Exit );
 	
+	#if SIMULATEISOCFAULTS
+	usbAudioStream->simulateHostJitter (&usbAudioStream->mSimulatedJitterState);
+	#endif
 	usbAudioStream->queueOutputFrames ();
     
 	if (TRUE == streamFormat->fIsMixable) 
 	{
-		if (usbAudioStream->mPlugin)
-		{
-			usbAudioStream->mPlugin->pluginProcess ((Float32*)mixBuf + (firstSampleFrame * streamFormat->fNumChannels), numSampleFrames, streamFormat->fNumChannels);
-		}
-		if (mPlugin) 
+		DJM03AudioPlugin *		streamPlugin = usbAudioStream->mPlugin;
+		DJM03AudioPlugin *		enginePlugin = (usbAudioStream == mMainOutputStream) ? mPlugin : NULL;
+		UInt32					blockFrames = getFusedClipBlockFrames (streamPlugin, enginePlugin, numSampleFrames, streamFormat->fNumChannels);
+		UInt32					frame;
+		UInt32					frames;
+
+		result = kIOReturnSuccess;
+		// Run the plugins and the clip routine over one block at a time, so that each sample is clipped while the
+		// plugins' output is still in the cache.
+		for (frame = 0; (frame < numSampleFrames) && (kIOReturnSuccess == result); frame += frames)
 		{
-			if (usbAudioStream == mMainOutputStream)
+			frames = numSampleFrames - frame;
+			if (frames > blockFrames)
+			{
+				frames = blockFrames;
+			}
+			if (streamPlugin)
+			{
+				streamPlugin->pluginProcess ((Float32*)mixBuf + ((firstSampleFrame + frame) * streamFormat->fNumChannels), frames, streamFormat->fNumChannels);
+			}
+			if (enginePlugin) 
+			{
+				enginePlugin->pluginProcess ((Float32*)mixBuf + ((firstSampleFrame + frame) * streamFormat->fNumChannels), frames, streamFormat->fNumChannels);
+			}
+			if (usbAudioStream->mChannelMapActive)
+			{
+				result = clipRoutedAudioToOutputStream (mixBuf, sampleBuf, firstSampleFrame + frame, frames, streamFormat, usbAudioStream->mChannelMap,
+														(kClipDitherNone != usbAudioStream->mDitherState.mode) ? &usbAudioStream->mDitherState : NULL);
+			}
+			else if (kClipDitherNone != usbAudioStream->mDitherState.mode)
+			{
+				result = clipAudioToOutputStreamWithDither (mixBuf, sampleBuf, firstSampleFrame + frame, frames, streamFormat, &usbAudioStream->mDitherState);
+			}
+			else
 			{
-				mPlugin->pluginProcess ((Float32*)mixBuf + (firstSampleFrame * streamFormat->fNumChannels), numSampleFrames, streamFormat->fNumChannels);
+				result = clipAudioToOutputStream (mixBuf, sampleBuf, firstSampleFrame + frame, frames, streamFormat);
+			}
+			if (usbAudioStream->mMeteringEnabled)
+			{
+				MeterClipSamples ((Float32*)mixBuf + ((firstSampleFrame + frame) * streamFormat->fNumChannels), frames, streamFormat, &usbAudioStream->mMeterState);
 			}
 		}
-		result = clipAudioToOutputStream (mixBuf, sampleBuf, firstSampleFrame, numSampleFrames, streamFormat);
 		
 		#if DEBUGLATENCY
 			if (!mHaveClipped)
@@ -299,11 +337,52 @@ IOReturn DJM03AudioEngine::clipOutputSamples (const void *mixBuf, void *sampleBu
 		mLastClippedFrame = firstSampleFrame + numSampleFrames;
 		result = kIOReturnSuccess;
 	}
+	#if LOGISOCSTATISTICS
+	usbAudioStream->updateIsocStatistics (startTime, 0);
+	#endif
 
 Exit:
 	return result;
 }
 
+// Returns how many frames clipOutputSamples should pass through the plugins and the clip routine at a time. Without
+// plugins the clip routine makes a single pass anyway, and a plugin that doesn't implement pluginGetProcessBlockFrames
+// still gets the whole buffer in one call.
+UInt32 DJM03AudioEngine::getFusedClipBlockFrames (DJM03AudioPlugin * streamPlugin, DJM03AudioPlugin * enginePlugin, UInt32 numSampleFrames, UInt32 numChannels)
+{
+	DJM03AudioPlugin *	plugins[2] = { streamPlugin, enginePlugin };
+	UInt32				blockFrames = numSampleFrames;
+	UInt32				pluginBlockFrames;
+
+	if ( ( ( NULL != streamPlugin ) || ( NULL != enginePlugin ) ) && ( 0 != numChannels ) )
+	{
+		blockFrames = kFusedClipBlockBytes / ( numChannels * sizeof ( Float32 ) );
+		if ( 0 == blockFrames )
+		{
+			blockFrames = 1;
+		}
+		for ( UInt32 pluginIndex = 0; pluginIndex < 2; pluginIndex++ )
+		{
+			if ( NULL == plugins[pluginIndex] )
+			{
+				continue;
+			}
+			pluginBlockFrames = plugins[pluginIndex]->pluginGetProcessBlockFrames ( numChannels );
+			if ( 0 == pluginBlockFrames )
+			{
+				blockFrames = numSampleFrames;
+				break;
+			}
+			if ( pluginBlockFrames < blockFrames )
+			{
+				blockFrames = pluginBlockFrames;
+			}
+		}
+	}
+
+	return blockFrames;
+}
+
 // [rdar://3918719] The following method now does the work of performFormatChange after being regulated by DJM03AudioDevice::formatChangeController().
 IOReturn DJM03AudioEngine::controlledFormatChange (IOAudioStream *audioStream, const IOAudioStreamFormat *newFormat, const IOAudioSampleRate *newSampleRate)
 {
@@ -484,12 +563,19 @@ IOReturn DJM03AudioEngine::convertInputSamples (const void *sampleBuf,
                                                                 UInt32 numSampleFrames,
                                                                 const IOAudioStreamFormat *streamFormat,
                                                                 IOAudioStream *audioStream) {
+	UInt32						bufferOffset;
 	UInt32						lastSampleByte;
 	UInt32						windowStartByte;
 	UInt32						windowEndByte;
+	UInt32						numFramesToConvert;
 	IOReturn					coalescenceErrorCode = kIOReturnSuccess;
 	IOReturn					result = kIOReturnSuccess;
 	DJM03AudioStream *			usbAudioStream;
+	#if LOGISOCSTATISTICS
+	UInt64						startTime;
+
+	clock_get_uptime (&startTime);
+	#endif
 	
 #if DEBUGCONVERT
 	debugIOLog ("+ DJM03AudioEngine::convertInputSamples (%p, %p, %lu, %lu, %p, %p)", sampleBuf, destBuf, firstSampleFrame, numSampleFrames, streamFormat, audioStream);
@@ -512,23 +598,24 @@ IOReturn DJM03AudioEngine::convertInputSamples (const void *sampleBuf,
 	// <rdar://7298196> Only perform the conversion if the audio engine is running.
 	if ( mUSBStreamRunning )
 	{
+		#if SIMULATEISOCFAULTS
+		usbAudioStream->simulateHostJitter (&usbAudioStream->mSimulatedJitterState);
+		#endif
 		usbAudioStream->queueInputFrames (); 
+		numFramesToConvert = numSampleFrames;
 		
-		// <rdar://problem/7378275>
-		if (usbAudioStream->mCoalescenceMutex)
-		{
-			IORecursiveLockLock (usbAudioStream->mCoalescenceMutex);
-		}
-		
+		// The readHandler may move mBufferOffset at any time, so work from one reading of it. CoalesceInputSamples ()
+		// takes its own consistent snapshot.
+		bufferOffset = usbAudioStream->mBufferOffset;
 		lastSampleByte = (firstSampleFrame + numSampleFrames) * streamFormat->fNumChannels * (streamFormat->fBitWidth / 8);
 		// Is the request inside our window of possibly recorded samples?
-		if (usbAudioStream->mBufferOffset + 1 > usbAudioStream->getSampleBufferSize ()) 
+		if (bufferOffset + 1 > usbAudioStream->getSampleBufferSize ()) 
 		{
 			windowStartByte = 0;
 		} 
 		else 
 		{
-			windowStartByte = usbAudioStream->mBufferOffset + 1;
+			windowStartByte = bufferOffset + 1;
 		}
 		windowEndByte = windowStartByte + (usbAudioStream->mNumUSBFrameListsToQueue * usbAudioStream->mReadUSBFrameListSize);
 		if (windowEndByte > usbAudioStream->getSampleBufferSize ()) 
@@ -540,18 +627,36 @@ IOReturn DJM03AudioEngine::convertInputSamples (const void *sampleBuf,
 			(windowStartByte < lastSampleByte && windowStartByte > windowEndByte && windowEndByte < lastSampleByte)) 
 		{
 			// debugIOLog ("%ld, %ld, %ld, %ld, %ld, %ld, %ld", firstSampleFrame * 4, numSampleFrames, lastSampleByte, usbAudioStream->mCurrentFrameList, usbAudioStream->mBufferOffset, windowStartByte, windowEndByte);
-			if (usbAudioStream->mBufferOffset < lastSampleByte) 
+			if (bufferOffset < lastSampleByte) 
 			{
-				// [rdar://5355808] Keep track of sample data underruns.
-				coalescenceErrorCode = usbAudioStream->CoalesceInputSamples (lastSampleByte - usbAudioStream->mBufferOffset, NULL);
+#if DIRECTINPUTCONVERT
+				UInt32		bytesPerSampleFrame = streamFormat->fNumChannels * (streamFormat->fBitWidth / 8);
+				UInt32		numFramesInBuffer = (bufferOffset / bytesPerSampleFrame) - firstSampleFrame;
+
+				// The samples past bufferOffset are still in the USB frame lists, so convert them from there rather than
+				// coalescing them into the sample buffer and converting them back out. Only the samples before bufferOffset
+				// are left to convert from the sample buffer below.
+				if (	(firstSampleFrame * bytesPerSampleFrame <= bufferOffset)
+					&&	(firstSampleFrame + numSampleFrames <= getNumSampleFramesPerBuffer ())
+					&&	!usbAudioStream->mChannelMapActive
+					&&	(kIOReturnSuccess == usbAudioStream->ConvertInputSamplesFromFrameLists (bufferOffset, lastSampleByte - bufferOffset, (Float32 *)destBuf + (numFramesInBuffer * streamFormat->fNumChannels), streamFormat)))
+				{
+					numFramesToConvert = numFramesInBuffer;
+				}
+				else
+#endif
+				{
+					// [rdar://5355808] Keep track of sample data underruns.
+					coalescenceErrorCode = usbAudioStream->CoalesceInputSamples (lastSampleByte - bufferOffset, NULL);
 #if DEBUGLOADING
-				debugIOLog ("! DJM03AudioEngine::convertInputSamples () - Coalesce from convert %d bytes", lastSampleByte - usbAudioStream->mBufferOffset);
+					debugIOLog ("! DJM03AudioEngine::convertInputSamples () - Coalesce from convert %d bytes", lastSampleByte - bufferOffset);
 #endif
+				}
 			} 
 			else 
 			{
 				// Have to wrap around the buffer.
-				UInt32		numBytesToCoalesce = usbAudioStream->getSampleBufferSize () - usbAudioStream->mBufferOffset + lastSampleByte;
+				UInt32		numBytesToCoalesce = usbAudioStream->getSampleBufferSize () - bufferOffset + lastSampleByte;
 				// [rdar://5355808] Keep track of sample data underruns.
 				coalescenceErrorCode = usbAudioStream->CoalesceInputSamples (numBytesToCoalesce, NULL);
 #if DEBUGLOADING
@@ -560,12 +665,24 @@ IOReturn DJM03AudioEngine::convertInputSamples (const void *sampleBuf,
 			}
 		}
 		
-		// <rdar://problem/7378275>
-		if (usbAudioStream->mCoalescenceMutex)
+		if (firstSampleFrame + numSampleFrames > getNumSampleFramesPerBuffer ())
 		{
-			IORecursiveLockUnlock (usbAudioStream->mCoalescenceMutex);
+			// IOAudioFamily splits requests at the end of the sample buffer; should one ever cross it, convert across the
+			// wrap rather than past the end of the buffer.
+			result = convertFromAudioInputStream (sampleBuf, getNumSampleFramesPerBuffer (), destBuf, firstSampleFrame, numSampleFrames, streamFormat);
+		}
+		else if (usbAudioStream->mChannelMapActive)
+		{
+			result = convertFromAudioInputStreamRouted_NoWrap (sampleBuf, destBuf, firstSampleFrame, numSampleFrames, streamFormat, usbAudioStream->mChannelMap);
+		}
+		else
+		{
+			result = convertFromAudioInputStream_NoWrap (sampleBuf, destBuf, firstSampleFrame, numFramesToConvert, streamFormat);
+		}
+		if (usbAudioStream->mMeteringEnabled)
+		{
+			MeterClipSamples ((Float32*)destBuf, numSampleFrames, streamFormat, &usbAudioStream->mMeterState);
 		}
-		result = convertFromAudioInputStream_NoWrap (sampleBuf, destBuf, firstSampleFrame, numSampleFrames, streamFormat);
 		
 		if (usbAudioStream->mPlugin)
 		{
@@ -584,6 +701,9 @@ IOReturn DJM03AudioEngine::convertInputSamples (const void *sampleBuf,
 			debugIOLog("sample 0 converted on USB frame %llu", mUSBAudioDevice->getUSBFrameNumber());
 		}
 #endif
+		#if LOGISOCSTATISTICS
+		usbAudioStream->updateIsocStatistics (startTime, 0);
+		#endif
 	}
 	
 Exit:	
@@ -2562,6 +2682,23 @@ void DJM03AudioEngine::runPolledTask () {
 		}
 	}
 	#endif // POLLCLOCKSTATUS
+
+	#if ADAPTIVEQUEUEDEPTH
+	// The isoc completions can't publish a new sample offset themselves.
+	if ( NULL != mIOAudioStreamArray )
+	{
+		for ( UInt32 streamIndex = 0; streamIndex < mIOAudioStreamArray->getCount (); streamIndex++ )
+		{
+			DJM03AudioStream * audioStream = OSDynamicCast (DJM03AudioStream, mIOAudioStreamArray->getObject (streamIndex) );
+			if	(		( NULL != audioStream )
+					&&	( audioStream->mQueueDepthChanged ) )
+			{
+				audioStream->mQueueDepthChanged = false;
+				audioStream->updateSampleOffsetAndLatency ();
+			}
+		}
+	}
+	#endif
 	
 Exit:
 	return;
@@ -93,15 +93,6 @@ class DJM03AudioDevice;
 #define kAnchorSamplingFreq3			kAnchorSamplingFreqSec/16		// <rdar://problem/7378275>
 #define kAnchorSamplingFreq4			kAnchorSamplingFreqSec/8		// <rdar://problem/7378275>
 
-#define RECORD_NUM_USB_FRAME_LISTS				32		//8,128
-#define RECORD_NUM_USB_FRAMES_PER_LIST			2
-#define RECORD_NUM_USB_FRAME_LISTS_TO_QUEUE		16		//4,64
-
-#define PLAY_NUM_USB_FRAME_LISTS				4
-#define PLAY_NUM_USB_FRAMES_PER_LIST			8		//8,64
-#define PLAY_NUM_USB_FRAME_LISTS_TO_QUEUE		2
-#define	PLAY_NUM_USB_FRAMES_PER_LIST_SYNC		4		//4,32
-
 // [rdar://5623096] Make note of the slowest polling interval in ms for feedback endpoints
 
 #define kMaxFeedbackPollingInterval				512
@@ -111,6 +102,9 @@ class DJM03AudioDevice;
 
 #define	kMaxTriesForStreamPropertiesReady		500	//  <rdar://problem/6686515> 500 x 10ms = 5 second timeout
 
+// Size of the mix buffer blocks that go through the plugins and the clip routine in one pass; well inside L1
+#define	kFusedClipBlockBytes					(16 * 1024)
+
 class DJM03AudioEngine;
 class DJM03AudioPlugin;
 class DJM03AudioStream;
@@ -230,6 +224,7 @@ protected:
 
 	virtual void resetClipPosition (IOAudioStream *audioStream, UInt32 clipSampleFrame);
     virtual IOReturn clipOutputSamples (const void *mixBuf, void *sampleBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat, IOAudioStream *audioStream);
+	UInt32 getFusedClipBlockFrames (DJM03AudioPlugin * streamPlugin, DJM03AudioPlugin * enginePlugin, UInt32 numSampleFrames, UInt32 numChannels);
 	virtual IOReturn convertInputSamples (const void *sampleBuf, void *destBuf, UInt32 firstSampleFrame, UInt32 numSampleFrames, const IOAudioStreamFormat *streamFormat, IOAudioStream *audioStream);
 	
     virtual IOReturn performFormatChange (IOAudioStream *audioStream, const IOAudioStreamFormat *newFormat, const IOAudioSampleRate *newSampleRate);
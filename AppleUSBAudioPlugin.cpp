@@ -32,8 +32,8 @@ OSDefineMetaClassAndStructors (DJM03AudioPlugin, IOService)
 
 OSMetaClassDefineReservedUsed(DJM03AudioPlugin, 0);
 OSMetaClassDefineReservedUsed(DJM03AudioPlugin, 1);
+OSMetaClassDefineReservedUsed(DJM03AudioPlugin, 2);
 
-OSMetaClassDefineReservedUnused(DJM03AudioPlugin, 2);
 OSMetaClassDefineReservedUnused(DJM03AudioPlugin, 3);
 OSMetaClassDefineReservedUnused(DJM03AudioPlugin, 4);
 OSMetaClassDefineReservedUnused(DJM03AudioPlugin, 5);
@@ -150,6 +150,14 @@ IOReturn DJM03AudioPlugin::pluginProcessInput (float * destBuf, UInt32 numSample
 	return kIOReturnSuccess;
 }
 
+// OSMetaClassDefineReservedUsed(DJM03AudioPlugin, 2);
+// A plugin that can process the mix buffer in pieces returns the largest number of frames it accepts per pluginProcess
+// call. The engine then runs the plugins and the clip routine block by block while each block is still in the cache.
+// Returning 0 (the default) keeps pluginProcess seeing the whole buffer at once.
+UInt32 DJM03AudioPlugin::pluginGetProcessBlockFrames (UInt32 numChannels) {
+	return 0;
+}
+
 IOReturn DJM03AudioPlugin::pluginStop () {
 	return kIOReturnSuccess;
 }
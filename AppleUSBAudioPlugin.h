@@ -50,12 +50,14 @@ public:
 	virtual IOReturn	pluginProcessInput (float * destBuf, UInt32 numSampleFrames, UInt32 numChannels);
 	// OSMetaClassDeclareReservedUsed (DJM03AudioPlugin, 1);
 	virtual IOReturn	pluginSetDirection (IOAudioStreamDirection direction);
+	// OSMetaClassDeclareReservedUsed (DJM03AudioPlugin, 2);
+	virtual UInt32		pluginGetProcessBlockFrames (UInt32 numChannels);
 
 private:
 	OSMetaClassDeclareReservedUsed (DJM03AudioPlugin, 0);
 	OSMetaClassDeclareReservedUsed (DJM03AudioPlugin, 1);
+	OSMetaClassDeclareReservedUsed (DJM03AudioPlugin, 2);
 
-	OSMetaClassDeclareReservedUnused (DJM03AudioPlugin, 2);
 	OSMetaClassDeclareReservedUnused (DJM03AudioPlugin, 3);
 	OSMetaClassDeclareReservedUnused (DJM03AudioPlugin, 4);
 	OSMetaClassDeclareReservedUnused (DJM03AudioPlugin, 5);
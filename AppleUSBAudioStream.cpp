@@ -39,6 +39,8 @@
 #include "AppleUSBAudioEngine.h"
 #include "AppleUSBAudioPlugin.h"
 
+#include <libkern/OSAtomic.h>
+
 //#undef debugIOLog
 //#define debugIOLog( message... ) do {IOLog( message );IOLog("\n");} while (0)
 
@@ -46,6 +48,16 @@
 
 OSDefineMetaClassAndStructors(DJM03AudioStream, IOAudioStream)
 
+// Indexed by the kLatencyProfile* values. The balanced profile is the geometry the driver has always used; 8 and 128
+// frame lists of input, and 64 frames per output list, have been tried before without much to show for it.
+static const LatencyProfile kLatencyProfiles[kLatencyProfileCount] =
+{
+	// record lists, frames per list, lists to queue; play lists, frames per list, lists to queue, frames per list (sync); ms
+	{ 16, 1,  8,	4, 4, 2, 2,		0 },		// kLatencyProfileUltraLow
+	{ 32, 2, 16,	4, 8, 2, 4,		0 },		// kLatencyProfileBalanced
+	{ 64, 2, 32,	8, 8, 4, 4,		1 }			// kLatencyProfileSafe
+};
+
 #pragma mark -IOKit Routines-
 
 void DJM03AudioStream::free () {
@@ -53,12 +65,6 @@ void DJM03AudioStream::free () {
 
 	debugIOLog ("+ DJM03AudioStream[%p]::free ()", this);
 
-	if (NULL != mCoalescenceMutex)
-	{
-		IORecursiveLockFree (mCoalescenceMutex);	// <rdar://problem/7378275>
-		mCoalescenceMutex = NULL;
-	}
-
 	if (NULL != mFrameQueuedForList) 
 	{
 		delete [] mFrameQueuedForList;
@@ -125,6 +131,12 @@ void DJM03AudioStream::free () {
 		mUSBCompletion = NULL;
 	}
 
+	if (NULL != mCoalescenceCopyLock)
+	{
+		IOSimpleLockFree (mCoalescenceCopyLock);
+		mCoalescenceCopyLock = NULL;
+	}
+
 	if (mUSBAudioDevice) 
 	{
 		mUSBAudioDevice->release ();
@@ -198,6 +210,11 @@ bool DJM03AudioStream::initWithAudioEngine (DJM03AudioDevice * device, DJM03Audi
 	
 	mInitStampDifference = true;	// <rdar://problem/7378275>
 	
+	InitClipDitherState (&mDitherState, kClipDitherNone);
+	mChannelMapActive = false;
+	mMeteringEnabled = false;
+	InitClipMeterState (&mMeterState, 0);
+
 	result = TRUE;
         
 Exit:
@@ -337,6 +354,301 @@ void DJM03AudioStream::registerService(IOOptionBits options)
 	debugIOLog ("- DJM03AudioStream[%p]::registerService ( 0x%lx )", this, options);
 }
 
+IOReturn DJM03AudioStream::setProperties (OSObject * properties)
+{
+	OSDictionary *		propertiesDict;
+	OSNumber *			number;
+	OSArray *			array;
+	OSBoolean *			boolean;
+	IOReturn			result = kIOReturnUnsupported;
+
+	propertiesDict = OSDynamicCast (OSDictionary, properties);
+	FailWithAction (NULL == propertiesDict, result = kIOReturnBadArgument, Exit);
+
+	number = OSDynamicCast (OSNumber, propertiesDict->getObject (kDitherModeKey));
+	if (number)
+	{
+		result = setDitherMode (number->unsigned32BitValue ());
+		FailIf (kIOReturnSuccess != result, Exit);
+	}
+
+	array = OSDynamicCast (OSArray, propertiesDict->getObject (kChannelMapKey));
+	if (array)
+	{
+		result = setChannelMap (array);
+		FailIf (kIOReturnSuccess != result, Exit);
+	}
+
+	boolean = OSDynamicCast (OSBoolean, propertiesDict->getObject (kMeteringKey));
+	if (boolean)
+	{
+		result = setMetering (boolean->isTrue ());
+		FailIf (kIOReturnSuccess != result, Exit);
+	}
+
+	number = OSDynamicCast (OSNumber, propertiesDict->getObject (kLatencyProfileKey));
+	if (number)
+	{
+		result = setLatencyProfile (number->unsigned32BitValue ());
+	}
+
+	if (kIOReturnUnsupported == result)
+	{
+		result = super::setProperties (properties);
+	}
+
+Exit:
+	return result;
+}
+
+// Output streams only. Takes effect with the next clipOutputSamples call. That call may be using mDitherState right now,
+// so the new state is built aside and copied in a word at a time, and the mode goes in last; the seeds it sees are never
+// all zero, which would leave the generators stuck there.
+IOReturn DJM03AudioStream::setDitherMode (UInt32 ditherMode)
+{
+	ClipDitherState		ditherState;
+	UInt32				i;
+	IOReturn			result = kIOReturnBadArgument;
+
+	FailIf (kIOAudioStreamDirectionOutput != mDirection, Exit);
+	FailIf (ditherMode > kClipDitherTPDFShaped, Exit);
+
+	debugIOLog ("? DJM03AudioStream[%p]::setDitherMode (%lu)", this, ditherMode);
+	InitClipDitherState (&ditherState, ditherMode);
+	for (i = 0; i < sizeof (ditherState.seed) / sizeof (ditherState.seed[0]); i++)
+	{
+		mDitherState.seed[i] = ditherState.seed[i];
+	}
+	for (i = 0; i < kClipDitherMaxChannels; i++)
+	{
+		mDitherState.error[i] = ditherState.error[i];
+	}
+	OSMemoryBarrier ();
+	mDitherState.mode = ditherMode;
+	setProperty (kDitherModeKey, ditherMode, 32);
+	result = kIOReturnSuccess;
+
+Exit:
+	return result;
+}
+
+// The map must have one entry per channel of the current format. The clip and convert calls read it without a lock, so
+// it is switched off while it changes; a buffer converted meanwhile is simply not routed.
+IOReturn DJM03AudioStream::setChannelMap (OSArray * channelMap)
+{
+	UInt8				map[kClipMaxRoutedChannels];
+	OSNumber *			number;
+	UInt32				count;
+	bool				identity = true;
+	IOReturn			result = kIOReturnBadArgument;
+
+	count = channelMap->getCount ();
+	FailIf ((0 != count) && (count != mNumChannels), Exit);
+	FailIf (count > kClipMaxRoutedChannels, Exit);
+
+	for (UInt32 channel = 0; channel < count; channel++)
+	{
+		number = OSDynamicCast (OSNumber, channelMap->getObject (channel));
+		FailIf (NULL == number, Exit);
+		map[channel] = (number->unsigned32BitValue () < count) ? number->unsigned8BitValue () : kClipChannelSilent;
+		if (map[channel] != channel)
+		{
+			identity = false;
+		}
+	}
+
+	debugIOLog ("? DJM03AudioStream[%p]::setChannelMap () - %lu channels%s", this, count, identity ? ", not routed" : "");
+	mChannelMapActive = false;
+	OSMemoryBarrier ();
+	if (identity)
+	{
+		removeProperty (kChannelMapKey);
+	}
+	else
+	{
+		memcpy (mChannelMap, map, count);
+		// The whole map has to be in place before the clip and convert calls see it switched on.
+		OSMemoryBarrier ();
+		mChannelMapActive = true;
+		setProperty (kChannelMapKey, channelMap);
+	}
+	result = kIOReturnSuccess;
+
+Exit:
+	return result;
+}
+
+// Only while the stream is stopped, since the frame lists are thrown away and allocated again with the new geometry. The
+// engine starts and changes format on its workloop, so the change is made under its command gate.
+IOReturn DJM03AudioStream::setLatencyProfile (UInt32 latencyProfile)
+{
+	IOCommandGate *		cg;
+	IOReturn			result = kIOReturnBadArgument;
+
+	FailIf (latencyProfile >= kLatencyProfileCount, Exit);
+	result = kIOReturnError;
+	FailIf (NULL == mUSBAudioEngine, Exit);
+	cg = mUSBAudioEngine->getCommandGate ();
+	FailIf (NULL == cg, Exit);
+
+	result = cg->runAction (latencyProfileAction, this, (void *)(uintptr_t)latencyProfile);
+
+Exit:
+	return result;
+}
+
+IOReturn DJM03AudioStream::latencyProfileAction (OSObject * owner, void * stream, void * latencyProfile, void * arg3, void * arg4)
+{
+	IOReturn			result = kIOReturnError;
+
+	FailIf (NULL == stream, Exit);
+	result = ((DJM03AudioStream *)stream)->protectedSetLatencyProfile ((UInt32)(uintptr_t)latencyProfile);
+
+Exit:
+	return result;
+}
+
+IOReturn DJM03AudioStream::protectedSetLatencyProfile (UInt32 latencyProfile)
+{
+	const LatencyProfile *				profile = &kLatencyProfiles[latencyProfile];
+	UInt64 *							frameQueuedForList = NULL;
+	IOUSBLowLatencyIsocCompletion *		usbCompletion = NULL;
+	IOSubMemoryDescriptor **			sampleBufferDescriptors = NULL;
+	UInt32								numUSBFrameLists = 0;
+	UInt32								i;
+	IOReturn							result = kIOReturnNotPermitted;
+
+	FailIf (mUSBStreamRunning, Exit);
+	FailWithAction (NULL == mFrameQueuedForList, result = kIOReturnNotReady, Exit);
+
+	debugIOLog ("? DJM03AudioStream[%p]::protectedSetLatencyProfile (%lu)", this, latencyProfile);
+	result = kIOReturnSuccess;
+	if (latencyProfile == mLatencyProfile)
+	{
+		goto Exit;
+	}
+
+	// Allocate for the new geometry first, so that running out of memory leaves the stream as it was.
+	numUSBFrameLists = (kUSBIn == mDirection) ? profile->recordNumUSBFrameLists : profile->playNumUSBFrameLists;
+	result = kIOReturnNoMemory;
+	frameQueuedForList = new UInt64[numUSBFrameLists];
+	FailIf (NULL == frameQueuedForList, Exit);
+	usbCompletion = (IOUSBLowLatencyIsocCompletion *)IOMalloc (numUSBFrameLists * sizeof (IOUSBLowLatencyIsocCompletion));
+	FailIf (NULL == usbCompletion, Exit);
+	sampleBufferDescriptors = (IOSubMemoryDescriptor **)IOMalloc (numUSBFrameLists * sizeof (IOSubMemoryDescriptor *));
+	FailIf (NULL == sampleBufferDescriptors, Exit);
+	bzero (sampleBufferDescriptors, numUSBFrameLists * sizeof (IOSubMemoryDescriptor *));
+
+	// Everything sized by the number of frame lists goes with the old geometry.
+	delete [] mFrameQueuedForList;
+	if (NULL != mSampleBufferDescriptors) 
+	{
+		for (i = 0; i < mNumUSBFrameLists; i++) 
+		{
+			if (NULL != mSampleBufferDescriptors[i]) 
+			{
+				mSampleBufferDescriptors[i]->release ();
+			}
+		}
+		IOFree (mSampleBufferDescriptors, mNumUSBFrameLists * sizeof (IOSubMemoryDescriptor *));
+	}
+	if (NULL != mUSBIsocFrames) 
+	{
+		IOFree (mUSBIsocFrames, mNumUSBFrameLists * mNumTransactionsPerList * sizeof (IOUSBLowLatencyIsocFrame));
+		mUSBIsocFrames = NULL;
+	}
+	if (NULL != mUSBCompletion) 
+	{
+		IOFree (mUSBCompletion, mNumUSBFrameLists * sizeof (IOUSBLowLatencyIsocCompletion));
+	}
+	mFrameQueuedForList = frameQueuedForList;
+	mUSBCompletion = usbCompletion;
+	mSampleBufferDescriptors = sampleBufferDescriptors;
+	frameQueuedForList = NULL;
+	usbCompletion = NULL;
+	sampleBufferDescriptors = NULL;
+
+	mLatencyProfile = latencyProfile;
+	applyLatencyProfile ();
+	setProperty (kLatencyProfileKey, mLatencyProfile, 32);
+
+	// Builds the isoc frames, the read buffer and the sample offsets for the new geometry.
+	result = controlledFormatChange (getFormat (), &mCurSampleRate);
+
+Exit:
+	if (NULL != frameQueuedForList)
+	{
+		delete [] frameQueuedForList;
+	}
+	if (NULL != usbCompletion)
+	{
+		IOFree (usbCompletion, numUSBFrameLists * sizeof (IOUSBLowLatencyIsocCompletion));
+	}
+	if (NULL != sampleBufferDescriptors)
+	{
+		IOFree (sampleBufferDescriptors, numUSBFrameLists * sizeof (IOSubMemoryDescriptor *));
+	}
+	return result;
+}
+
+// Sets the frame list geometry from mLatencyProfile. The output frame lists may still be shortened by
+// checkForFeedbackEndpoint () once the alternate setting is known.
+void DJM03AudioStream::applyLatencyProfile (void)
+{
+	const LatencyProfile *	profile = &kLatencyProfiles[mLatencyProfile];
+
+	if (kUSBIn == mDirection) 
+	{
+		mNumUSBFrameLists = profile->recordNumUSBFrameLists;
+		mNumUSBFramesPerList = profile->recordNumUSBFramesPerList;
+		mMaxNumUSBFrameListsToQueue = profile->recordNumUSBFrameListsToQueue;
+	}
+	else
+	{
+		mNumUSBFrameLists = profile->playNumUSBFrameLists;
+		mNumUSBFramesPerList = profile->playNumUSBFramesPerList;
+		mMaxNumUSBFrameListsToQueue = profile->playNumUSBFrameListsToQueue;
+	}
+	mNumUSBFrameListsToQueue = mMaxNumUSBFrameListsToQueue;
+	debugIOLog ("? DJM03AudioStream[%p]::applyLatencyProfile () - profile %lu: %lu lists of %lu frames, %lu queued", this, mLatencyProfile, mNumUSBFrameLists, mNumUSBFramesPerList, mNumUSBFrameListsToQueue);
+}
+
+// The meters start from zero every time they are turned on.
+IOReturn DJM03AudioStream::setMetering (bool enable)
+{
+	IOReturn			result = kIOReturnBadArgument;
+
+	FailIf (enable && (mNumChannels > kClipMeterMaxChannels), Exit);
+
+	debugIOLog ("? DJM03AudioStream[%p]::setMetering (%d)", this, enable);
+	mMeteringEnabled = false;
+	if (enable)
+	{
+		InitClipMeterState (&mMeterState, mNumChannels);
+		mMeteringEnabled = true;
+	}
+	setProperty (kMeteringKey, enable);
+	result = kIOReturnSuccess;
+
+Exit:
+	return result;
+}
+
+// Lock free, so it can be called from any context, including a plugin's pluginProcess ().
+IOReturn DJM03AudioStream::getMeterSnapshot (ClipMeterState * snapshot, bool reset)
+{
+	IOReturn			result = kIOReturnNotReady;
+
+	FailWithAction (NULL == snapshot, result = kIOReturnBadArgument, Exit);
+	FailIf (!mMeteringEnabled, Exit);
+
+	GetClipMeterSnapshot (&mMeterState, snapshot, reset);
+	result = kIOReturnSuccess;
+
+Exit:
+	return result;
+}
+
 #pragma mark -USB Audio driver-
 
 IOReturn DJM03AudioStream::addAvailableFormats (DJM03ConfigurationDictionary * configDictionary)
@@ -405,11 +717,17 @@ IOReturn DJM03AudioStream::addAvailableFormats (DJM03ConfigurationDictionary * c
 		// [rdar://5284099] Check the format before deciding whether to retrieve the following values.
 		FailIf (kIOReturnSuccess != configDictionary->getFormat (&format, mInterfaceNumber, altSettingIndex), Exit);
 		if (		( PCM == format )
+				||	( IEEE_FLOAT == format )
 				||	( IEC1937_AC3 == format ) )
 		{
 			FailIf (kIOReturnSuccess != configDictionary->getNumChannels (&numChannels, mInterfaceNumber, altSettingIndex), Exit);
 			FailIf (kIOReturnSuccess != configDictionary->getBitResolution (&(streamFormat.fBitDepth), mInterfaceNumber, altSettingIndex), Exit);
 			FailIf (kIOReturnSuccess != configDictionary->getSubframeSize (&(streamFormat.fBitWidth), mInterfaceNumber, altSettingIndex), Exit);
+			if ( ( IEEE_FLOAT == format ) && ( 4 != streamFormat.fBitWidth ) )
+			{
+				// Only Float32 matches the mix buffer.
+				numChannels = 0;
+			}
 		}
 		else
 		{
@@ -427,7 +745,7 @@ IOReturn DJM03AudioStream::addAvailableFormats (DJM03ConfigurationDictionary * c
 		streamFormatExtension.fFramesPerPacket = 1;
 		streamFormatExtension.fBytesPerPacket = numChannels * (streamFormat.fBitWidth / 8);
 		streamFormat.fSampleFormat = kIOAudioStreamSampleFormatLinearPCM;
-		streamFormat.fNumericRepresentation = kIOAudioStreamNumericRepresentationSignedInt;
+		streamFormat.fNumericRepresentation = ( IEEE_FLOAT == format ) ? kIOAudioStreamNumericRepresentationIEEE754Float : kIOAudioStreamNumericRepresentationSignedInt;
 		streamFormat.fIsMixable = TRUE;
 		if (2 == streamFormat.fNumChannels && 16 == streamFormat.fBitDepth && 16 == streamFormat.fBitWidth) 
 		{
@@ -729,7 +1047,7 @@ IOReturn DJM03AudioStream::checkForFeedbackEndpoint (DJM03ConfigurationDictionar
 			mRefreshInterval = mRefreshInterval ? mRefreshInterval : kMinimumSyncRefreshInterval;
 			mFramesUntilRefresh = 1 << mRefreshInterval;		// the same as 2^mRefreshInterval
 			
-			// If the hardware needs to be updated more often than PLAY_NUM_USB_FRAMES_PER_LIST ms, change list size to PLAY_NUM_USB_FRAMES_PER_LIST_SYNC frames.			
+			// If the hardware needs to be updated more often than the latency profile's frames per list, change list size to its sync frames per list.			
 			if (mFramesUntilRefresh < mNumUSBFramesPerList) 
 			{
 				debugIOLog ("? DJM03AudioStream[%p]::checkForFeedbackEndpoint () - Need to adjust mNumUSBFramesPerList: %ld < %ld", mFramesUntilRefresh, mNumUSBFramesPerList);
@@ -739,9 +1057,9 @@ IOReturn DJM03AudioStream::checkForFeedbackEndpoint (DJM03ConfigurationDictionar
 					IOFree (mUSBIsocFrames, mNumUSBFrameLists * mNumTransactionsPerList * sizeof (IOUSBLowLatencyIsocFrame));
 					mUSBIsocFrames = NULL;
 				}
-				mNumUSBFramesPerList = PLAY_NUM_USB_FRAMES_PER_LIST_SYNC;
+				mNumUSBFramesPerList = kLatencyProfiles[mLatencyProfile].playNumUSBFramesPerListSync;
 				mNumTransactionsPerList = mNumUSBFramesPerList * mTransactionsPerUSBFrame;
-				mNumUSBFrameLists = mNumUSBFrameListsToQueue * 2;
+				mNumUSBFrameLists = mMaxNumUSBFrameListsToQueue * 2;
 				debugIOLog ("? DJM03AudioStream[%p]::checkForFeedbackEndpoint () - mNumUSBFramesPerList = %d, mNumUSBFrameListsToQueue = %d, mNumUSBFrameLists = %d", this, mNumUSBFramesPerList, mNumUSBFrameListsToQueue, mNumUSBFrameLists);
 				mUSBIsocFrames = (IOUSBLowLatencyIsocFrame *)IOMalloc (mNumUSBFrameLists * mNumTransactionsPerList * sizeof (IOUSBLowLatencyIsocFrame));
 				debugIOLog ("? DJM03AudioStream[%p]::checkForFeedbackEndpoint () - mUSBIsocFrames is now %p", this, mUSBIsocFrames);
@@ -791,6 +1109,174 @@ Exit:
 	return result;
 }
 
+// The packets ConcealInputPacket () fills in: empty from an overrun, or cut short once the stream is running. A packet
+// that has been concealed no longer matches, since its frActCount has been raised.
+bool DJM03AudioStream::isInputPacketToConceal (IOUSBLowLatencyIsocFrame * frame) {
+	return	(		(		(kIOReturnOverrun == frame->frStatus)
+						&&	(0 == frame->frActCount))
+				||	(		(kIOReturnUnderrun == frame->frStatus)
+						&&	(0 != frame->frActCount)
+						&&	(frame->frActCount < (mAverageFrameSize - 2 * mSampleSize))			// [rdar://5889101]
+						&&	(mHaveTakenFirstTimeStamp)));
+}
+
+// Packet-loss concealment for a packet that came back empty from an overrun, or cut short. Fills in the packet in
+// mReadBuffer up to mAverageFrameSize and then sets its frActCount, so the coalesced stream keeps its timing and goes on
+// from the audio around the gap rather than from stale bytes. A gap of up to kConcealInterpolateFrames sample frames with
+// the next packet at hand is bridged with a straight line. A longer gap repeats the sample frames just before it, bent to
+// start where the audio left off and to end where the next packet starts. Only the readHandler conceals, so it stays the
+// only writer of the frame lists; until it has, the CoreAudio thread treats the packet as not ready. This runs in the USB
+// completion, so it sticks to integer math, and Float32 streams just get the repeat.
+void DJM03AudioStream::ConcealInputPacket (IOUSBLowLatencyIsocFrame * pFrames, UInt32 usbFrameIndex, UInt32 firstUSBFrameIndex, UInt8 * packet, UInt32 bufferOffset) {
+	IOUSBLowLatencyIsocFrame *		nextFrame = NULL;
+	UInt8 *							nextPacket = NULL;
+	UInt8 *							gap;
+	UInt32							numBytesPresent;
+	UInt32							numBytesWanted;
+	UInt32							numFramesMissing;
+	UInt32							subframeSize;
+	UInt32							frameIndex;
+	UInt32							channel;
+	SInt64							last;
+	SInt64							startDelta;
+	SInt64							endDelta;
+	SInt64							value;
+
+	FailIf (0 == mSampleSize, Exit);
+	FailIf (0 == mNumChannels, Exit);
+	subframeSize = mSampleSize / mNumChannels;
+	numBytesPresent = pFrames[usbFrameIndex].frActCount - (pFrames[usbFrameIndex].frActCount % mSampleSize);
+	numBytesWanted = (mAverageFrameSize < pFrames[usbFrameIndex].frReqCount) ? mAverageFrameSize : pFrames[usbFrameIndex].frReqCount;
+	numBytesWanted -= numBytesWanted % mSampleSize;
+	FailIf (numBytesWanted <= numBytesPresent, Exit);
+	numFramesMissing = (numBytesWanted - numBytesPresent) / mSampleSize;
+	gap = packet + numBytesPresent;
+
+	// The next packet follows this one in mReadBuffer, unless this is the last packet before the frame lists wrap.
+	if ((usbFrameIndex + 1 + firstUSBFrameIndex) < (mNumUSBFrameLists * mNumTransactionsPerList))
+	{
+		nextFrame = &pFrames[usbFrameIndex + 1];
+		if	(		((kIOReturnSuccess == nextFrame->frStatus) || (kIOReturnUnderrun == nextFrame->frStatus))
+				&&	(nextFrame->frActCount >= mSampleSize))
+		{
+			nextPacket = packet + pFrames[usbFrameIndex].frReqCount;
+		}
+	}
+
+	if (mFloatFormat)
+	{
+		for (frameIndex = 0; frameIndex < numFramesMissing; frameIndex++)
+		{
+			memcpy (gap + frameIndex * mSampleSize, getConcealmentHistory (packet, numBytesPresent, bufferOffset, numFramesMissing - frameIndex), mSampleSize);
+		}
+	}
+	else
+	{
+		for (channel = 0; channel < mNumChannels; channel++)
+		{
+			last = getConcealmentSample (getConcealmentHistory (packet, numBytesPresent, bufferOffset, 1) + channel * subframeSize, subframeSize);
+			// The repeat should start from where the last two sample frames were heading.
+			startDelta = 2 * last - getConcealmentSample (getConcealmentHistory (packet, numBytesPresent, bufferOffset, 2) + channel * subframeSize, subframeSize);
+			startDelta -= getConcealmentSample (getConcealmentHistory (packet, numBytesPresent, bufferOffset, numFramesMissing) + channel * subframeSize, subframeSize);
+			endDelta = (NULL != nextPacket) ? getConcealmentSample (nextPacket + channel * subframeSize, subframeSize) - last : 0;
+			for (frameIndex = 0; frameIndex < numFramesMissing; frameIndex++)
+			{
+				if ((NULL != nextPacket) && (numFramesMissing <= kConcealInterpolateFrames))
+				{
+					value = last + (endDelta * (frameIndex + 1)) / (numFramesMissing + 1);
+				}
+				else
+				{
+					value = getConcealmentSample (getConcealmentHistory (packet, numBytesPresent, bufferOffset, numFramesMissing - frameIndex) + channel * subframeSize, subframeSize);
+					value += (startDelta * (numFramesMissing - frameIndex)) / numFramesMissing;
+					value += (endDelta * (frameIndex + 1)) / (numFramesMissing + 1);
+				}
+				setConcealmentSample (gap + frameIndex * mSampleSize + channel * subframeSize, subframeSize, value);
+			}
+		}
+	}
+
+	// The samples have to be in place before anyone sees the new count.
+	OSMemoryBarrier ();
+	pFrames[usbFrameIndex].frActCount = numBytesWanted;
+	mConcealedPackets++;
+
+Exit:
+	return;
+}
+
+// Returns the sample frame numFramesBack (1 for the last one) before the gap in a packet being concealed. The frames
+// before the packet itself are the ones already coalesced in front of bufferOffset, where the packet goes.
+UInt8 * DJM03AudioStream::getConcealmentHistory (UInt8 * packet, UInt32 numBytesPresent, UInt32 bufferOffset, UInt32 numFramesBack) {
+	UInt32							numBytesBack;
+
+	numBytesBack = numFramesBack * mSampleSize;
+	if (numBytesBack <= numBytesPresent)
+	{
+		return packet + numBytesPresent - numBytesBack;
+	}
+	numBytesBack = (numBytesBack - numBytesPresent) % getSampleBufferSize ();
+
+	return (UInt8 *)getSampleBuffer () + ((bufferOffset + getSampleBufferSize () - numBytesBack) % getSampleBufferSize ());
+}
+
+SInt64 DJM03AudioStream::getConcealmentSample (UInt8 * sample, UInt32 subframeSize) {
+	switch (subframeSize)
+	{
+		case 1:
+			return (SInt8)sample[0];
+		case 2:
+			return (SInt16)(sample[0] | (sample[1] << 8));
+		case 3:
+			return ((SInt32)((sample[0] << 8) | (sample[1] << 16) | ((UInt32)sample[2] << 24))) >> 8;
+		default:
+			return (SInt32)(sample[0] | (sample[1] << 8) | (sample[2] << 16) | ((UInt32)sample[3] << 24));
+	}
+}
+
+// Stores value as a little endian sample subframeSize bytes wide, clipped to what fits.
+void DJM03AudioStream::setConcealmentSample (UInt8 * sample, UInt32 subframeSize, SInt64 value) {
+	SInt64							maxValue;
+	UInt32							byteIndex;
+
+	maxValue = (1LL << (subframeSize * 8 - 1)) - 1;
+	if (value > maxValue)
+	{
+		value = maxValue;
+	}
+	else if (value < -maxValue - 1)
+	{
+		value = -maxValue - 1;
+	}
+	for (byteIndex = 0; byteIndex < subframeSize; byteIndex++)
+	{
+		sample[byteIndex] = (UInt8)(value >> (byteIndex * 8));
+	}
+}
+
+// Copies numFrames packets, each of which starts frReqCount bytes after the one before it in mReadBuffer, to consecutive
+// bytes at dest. byteCounts holds the frActCount of each packet as it was read when the run was put together. A packet
+// that filled its request runs straight into the next one, so they share a memcpy.
+void DJM03AudioStream::CopyInputRun (UInt8 * dest, UInt8 * source, IOUSBLowLatencyIsocFrame * pFrames, UInt16 * byteCounts, UInt32 numFrames) {
+	UInt32							frameIndex;
+	UInt32							numBytesInBlock = 0;
+
+	for (frameIndex = 0; frameIndex < numFrames; frameIndex++)
+	{
+		numBytesInBlock += byteCounts[frameIndex];
+		if ((byteCounts[frameIndex] != pFrames[frameIndex].frReqCount) || (frameIndex + 1 == numFrames))
+		{
+			if (0 != numBytesInBlock)
+			{
+				memcpy (dest, source, numBytesInBlock);
+			}
+			dest += numBytesInBlock;
+			source += numBytesInBlock + (pFrames[frameIndex].frReqCount - byteCounts[frameIndex]);
+			numBytesInBlock = 0;
+		}
+	}
+}
+
 // This function is called from both the IOProc's call to convertInputSamples and by the readHandler.
 // To figure out where to start coalescing from, it looks at the mCurrentFrameList, which is updated by the readHandler.
 // It will copy from currentFameList+1 the number of bytes requested or one USB frame list.
@@ -799,6 +1285,11 @@ Exit:
 // When called from the readHandler it will just coalesce one USB frame starting from mCurrentFrameList.
 // When called from convertInputSamples, it will convert the number of bytes that corresponds to the number of samples that are being asked to be converted,
 // starting from mCurrentFrameList.
+// No lock is held while coalescing. The readHandler is the only writer of mCurrentFrameList and mBufferOffset, and it makes
+// mCoalescenceSequence odd while it coalesces a frame list and moves on to the next one. The CoreAudio thread works from
+// a snapshot of the two, taken while the sequence is even, and starts over if the sequence changes before a copy. Each
+// check and the copy after it are made under mCoalescenceCopyLock, which the readHandler takes before it makes the
+// sequence odd, so a checked copy can't land in the sample buffer after the readHandler has coalesced over it.
 
 IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUSBLowLatencyIsocFrame * pFrames) {
 	IOReturn						result = kIOReturnSuccess;
@@ -807,10 +1298,18 @@ IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUS
 	UInt32							firstUSBFrameIndex;		//	<rdar://6094454>
 	UInt32							totalNumUSBFrames;		//	<rdar://6094454>
 	UInt32							numFramesChecked;
+	UInt32							numFramesInRun;
+	UInt32							runIndex;
+	UInt16							runByteCounts[kMaxInputRunFrames];
+	IOReturn						frameStatus;
+	UInt16							frameActCount;
 	UInt32							numBytesToCopy;
 	UInt32							numBytesToEnd;
 	UInt32							numBytesCopied;
-	UInt32							originalBufferOffset;
+	UInt32							frameList;
+	UInt32							bufferOffset;
+	UInt32							sequence = 0;
+	UInt32							attempts = 0;
 	SInt32							numBytesLeft;
 	UInt32							preWrapBytes = 0;
 	UInt32							byteCount = 0;
@@ -826,25 +1325,16 @@ IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUS
 	UInt32							firstUSBFrameIndexOnLastCopy;
 	IOUSBLowLatencyIsocFrame *		pFramesOnLastCopy;
 #endif
+	IOUSBLowLatencyIsocFrame *		requestedFrames = pFrames;
     
-	if (mCoalescenceMutex)
-	{
-		IORecursiveLockLock (mCoalescenceMutex);
-	}
-	
 	#if DEBUGINPUT
 	debugIOLog ("+ DJM03AudioStream[%p]::CoalesceInputSamples (%lu, %p)", this, numBytesToCoalesce, pFrames); 
 	#endif
 	
-	originalBufferOffset = 0;
 	if (0 != numBytesToCoalesce) 
 	{
 		// This is being called from the CoreAudio thread
 		onCoreAudioThread = true;
-		originalBufferOffset = mBufferOffset;		// So that when we later get called from the readHandler that we'll put everything in the right spot
-		#if DEBUGINPUT
-		debugIOLog ("! DJM03AudioStream[%p]::CoalesceInputSamples () - Coalesce from %ld %ld bytes (framelist %ld) on CoreAudio thread", this, originalBufferOffset, numBytesToCoalesce, mCurrentFrameList);
-		#endif
 		if ( mMasterMode && !mHaveTakenFirstTimeStamp )
 		{
 			debugIOLog ("! DJM03AudioStream[%p]::CoalesceInputSamples () - CoreAudio thread is asking for samples without having been sent a timestamp!", this );
@@ -855,19 +1345,39 @@ IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUS
 		onCoreAudioThread = false;
 	}
 
+Retry:
+	if (onCoreAudioThread)
+	{
+		// The copies on this thread only go to a local position, so that the readHandler puts everything in the right spot later.
+		while (!getCoalescencePosition (&sequence, &frameList, &bufferOffset))
+		{
+			FailIf (++attempts > kMaxCoalescenceAttempts, Exit);
+			IODelay (1);
+		}
+		#if DEBUGINPUT
+		debugIOLog ("! DJM03AudioStream[%p]::CoalesceInputSamples () - Coalesce from %ld %ld bytes (framelist %ld) on CoreAudio thread", this, bufferOffset, numBytesToCoalesce, frameList);
+		#endif
+	}
+	else
+	{
+		frameList = mCurrentFrameList;
+		bufferOffset = mBufferOffset;
+	}
+
+	pFrames = requestedFrames;
 	if (NULL == pFrames) 
 	{
-		pFrames = &mUSBIsocFrames[mCurrentFrameList * mNumTransactionsPerList];
+		pFrames = &mUSBIsocFrames[frameList * mNumTransactionsPerList];
 	}
 
-	dest = (UInt8 *)getSampleBuffer () + mBufferOffset;
-	source = (UInt8 *)mReadBuffer + (mCurrentFrameList * mReadUSBFrameListSize);
+	dest = (UInt8 *)getSampleBuffer () + bufferOffset;
+	source = (UInt8 *)mReadBuffer + (frameList * mReadUSBFrameListSize);
 
 	//	<rdar://6094454>	Pre-compute these values here instead in the while loop. There is a race condition where 
 	//	mCurrentFrameList is updated in the readHandler(), and if it changes, then it could cause usbFrameIndex to get
 	//	out of range when accessing pFrames. firstUSBFrameIndex should be tied to pFrames, so it should only change 
 	//	when pFrames changes in the wrap situation. totalNumUSBFrames shouldn't change at all.	
-	firstUSBFrameIndex = (mCurrentFrameList * mNumTransactionsPerList);
+	firstUSBFrameIndex = (frameList * mNumTransactionsPerList);
 	totalNumUSBFrames = (mNumUSBFrameLists * mNumTransactionsPerList);
 
 	usbFrameIndex = 0;
@@ -880,6 +1390,19 @@ IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUS
 			&& ('llit' != pFrames[usbFrameIndex].frStatus)			// IOUSBFamily is processing this now
 			&& (-1 != pFrames[usbFrameIndex].frStatus))				// IOUSBFamily hasn't gotten here yet
 	{
+		if (onCoreAudioThread)
+		{
+			// Only the readHandler writes to the frame lists, so a packet that still has to be concealed isn't ready yet.
+			if (isInputPacketToConceal (&pFrames[usbFrameIndex]))
+			{
+				break;
+			}
+		}
+		else if (kIOReturnSuccess == pFrames[usbFrameIndex].frStatus)
+		{
+			mConsecutiveOverruns = 0;
+		}
+
 		// Log unusual status here
 		if (		(!(mShouldStop))
 				&&	(		(kIOReturnSuccess != pFrames[usbFrameIndex].frStatus)
@@ -897,15 +1420,15 @@ IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUS
 			// host controller behaves differently).
 			if ( ( kIOReturnOverrun == pFrames[usbFrameIndex].frStatus ) && ( 0 == pFrames[usbFrameIndex].frActCount ) )
 			{
-				// Set the frActCount to frReqCount so that at least the timing is somewhat preserved and not dropping the
-				// whole packet.
-				pFrames[usbFrameIndex].frActCount = pFrames[usbFrameIndex].frReqCount;
+				// Make up the packet from the audio around it so that the timing is preserved and the gap doesn't click.
+				ConcealInputPacket (pFrames, usbFrameIndex, firstUSBFrameIndex, source, bufferOffset);
 				mOverrunsCount++;
+				mConsecutiveOverruns++;
 				
-				// If there is too many overruns, the audio stream is possibly corrupt constantly, so restart the 
+				// If there are too many overruns in a row, the audio stream is possibly corrupt constantly, so restart the 
 				// audio engine if the engine has multiple streams and this input stream is the master stream. This
-				// is to prevent the continous corruptions.
-				if ( mMasterMode && ( mOverrunsCount >= mOverrunsThreshold ) )
+				// is to prevent the continous corruptions. The odd overrun is concealed and left at that.
+				if ( mMasterMode && ( mConsecutiveOverruns >= mOverrunsThreshold ) )
 				{
 					if ( mUSBAudioDevice && mUSBAudioEngine && mUSBAudioEngine->mIOAudioStreamArray )
 					{
@@ -917,13 +1440,21 @@ IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUS
 					}
 				}
 			}
+			else if	(		( kIOReturnUnderrun == pFrames[usbFrameIndex].frStatus )
+						&&	( 0 != pFrames[usbFrameIndex].frActCount )
+						&&	( mHaveTakenFirstTimeStamp ) )
+			{
+				// A packet this short once the stream is running has lost samples, so fill them in the same way.
+				ConcealInputPacket (pFrames, usbFrameIndex, firstUSBFrameIndex, source, bufferOffset);
+			}
 		}
 		
-		numBytesToEnd = getSampleBufferSize () - mBufferOffset;
+		numBytesToEnd = getSampleBufferSize () - bufferOffset;
+		numFramesInRun = 1;
 		
 		// We should take the first time stamp now if we are receiving our first byte when we expect; otherwise wait until the first buffer loop.
 		if	(		(!mHaveTakenFirstTimeStamp)
-				&&	(0 == mBufferOffset)
+				&&	(0 == bufferOffset)
 				&&	(pFrames[usbFrameIndex].frActCount > 0))
 		{
 			if ( mMasterMode && !mShouldStop )										// <rdar://problem/7378275>
@@ -946,16 +1477,28 @@ IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUS
 		else 
 		{
 			numBytesToCopy = pFrames[usbFrameIndex].frActCount;
-			if (0 == numBytesToCoalesce) 
+			// Take the clean packets that follow along in one run, so they skip the checks above and are gathered by one
+			// CopyInputRun () below. The packet that wraps the sample buffer, finishes the request or ends the frame list,
+			// and any packet with an unusual status, still goes through the loop on its own. Each count is read once, so
+			// the packets land where they were counted even if the readHandler starts on them in the meantime.
+			runByteCounts[0] = numBytesToCopy;
+			while (		(numFramesInRun < kMaxInputRunFrames)
+					&&	((usbFrameIndex + numFramesInRun + firstUSBFrameIndex) < totalNumUSBFrames)
+					&&	((0 != numBytesToCoalesce) || ((usbFrameIndex + numFramesInRun) < mNumTransactionsPerList))
+					&&	((numFramesChecked + numFramesInRun) < (mNumTransactionsPerList * mNumUSBFrameLists)))
 			{
-				pFrames[usbFrameIndex].frActCount = 0;
-				#ifdef DEBUG
-				// We don't want to see these frames logged as errors later, so cook the error code if necessary.
-				if	(kIOReturnUnderrun == pFrames[usbFrameIndex].frStatus)
-				{ 
-					pFrames[usbFrameIndex].frStatus = kIOReturnSuccess;
+				frameStatus = pFrames[usbFrameIndex + numFramesInRun].frStatus;
+				frameActCount = pFrames[usbFrameIndex + numFramesInRun].frActCount;
+				if (	(		(kIOReturnSuccess != frameStatus)
+							&&	(		(kIOReturnUnderrun != frameStatus)
+									||	(frameActCount < (mAverageFrameSize - 2 * mSampleSize))))
+					||	((numBytesToCopy + frameActCount) >= numBytesToEnd)
+					||	((0 != numBytesToCoalesce) && ((SInt32)(numBytesToCopy + frameActCount) >= numBytesLeft)))
+				{
+					break;
 				}
-				#endif DEBUG
+				runByteCounts[numFramesInRun++] = frameActCount;
+				numBytesToCopy += frameActCount;
 			}
 		}
 #if DEBUGINPUT
@@ -968,110 +1511,408 @@ IOReturn DJM03AudioStream::CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUS
 			pFramesOnLastCopy = pFrames;
 		}
 #endif		
-		if (0 != numBytesToCopy)
+		// If the readHandler has moved on since the snapshot, the frame counts read above may already have been consumed.
+		// Otherwise it can't move on until the copies below are done.
+		if (onCoreAudioThread && !lockCoalescencePosition (sequence))
 		{
-			memcpy (dest, source, numBytesToCopy);
-			mBufferOffset 	+= numBytesToCopy;
-			numBytesLeft 	-= numBytesToCopy;
+			FailIf (++attempts > kMaxCoalescenceAttempts, Exit);
+			goto Retry;
 		}
+		if (1 == numFramesInRun)
+		{
+			if (0 != numBytesToCopy)
+			{
+				memcpy (dest, source, numBytesToCopy);
+			}
+		}
+		else
+		{
+			CopyInputRun (dest, source, &pFrames[usbFrameIndex], runByteCounts, numFramesInRun);
+		}
+		bufferOffset 	+= numBytesToCopy;
+		numBytesLeft 	-= numBytesToCopy;
 		numBytesCopied 	= numBytesToCopy;
+		
+		if (0 == numBytesToCoalesce) 
+		{
+			for (runIndex = usbFrameIndex; runIndex < usbFrameIndex + numFramesInRun; runIndex++)
+			{
+				// The readHandler is done with these frames unless the copy wraps, which is dealt with below.
+				if ((UInt32)(pFrames[runIndex].frActCount) < numBytesToEnd)
+				{
+					pFrames[runIndex].frActCount = 0;
+					#ifdef DEBUG
+					// We don't want to see these frames logged as errors later, so cook the error code if necessary.
+					if	(kIOReturnUnderrun == pFrames[runIndex].frStatus)
+					{ 
+						pFrames[runIndex].frStatus = kIOReturnSuccess;
+					}
+					#endif DEBUG
+				}
+			}
+		}
 
 		if (pFrames[usbFrameIndex].frActCount >= numBytesToEnd) 				// <rdar://problem/7378275>
 		{
-			numBytesToCopy = pFrames[usbFrameIndex].frActCount - numBytesToEnd;
-			dest = (UInt8 *)getSampleBuffer ();
-			memcpy (dest, source + numBytesCopied, numBytesToCopy);
-			mBufferOffset = numBytesToCopy;
-			numBytesLeft -= numBytesToCopy;
-
-			if (0 == numBytesToCoalesce) 
-			{
-				if ( mMasterMode && !mShouldStop )								// <rdar://problem/7378275>
-				{
-					// we have wrapped and we were called by the completion routine -- take timestamp
-					// Calculate a time stamp based on our filtered rates
-					time = generateTimeStamp (usbFrameIndex, preWrapBytes, byteCount);
-					takeTimeStamp (TRUE, &time);
-				}
-			}
+			numBytesToCopy = pFrames[usbFrameIndex].frActCount - numBytesToEnd;
+			dest = (UInt8 *)getSampleBuffer ();
+			memcpy (dest, source + numBytesCopied, numBytesToCopy);
+			bufferOffset = numBytesToCopy;
+			numBytesLeft -= numBytesToCopy;
+
+			if (0 == numBytesToCoalesce) 
+			{
+				if ( mMasterMode && !mShouldStop )								// <rdar://problem/7378275>
+				{
+					// we have wrapped and we were called by the completion routine -- take timestamp
+					// Calculate a time stamp based on our filtered rates
+					time = generateTimeStamp (usbFrameIndex, preWrapBytes, byteCount);
+					takeTimeStamp (TRUE, &time);
+				}
+			}
+		}
+		if (onCoreAudioThread)
+		{
+			unlockCoalescencePosition ();
+		}
+
+		dest += numBytesToCopy;
+		do
+		{
+			source += pFrames[usbFrameIndex].frReqCount;
+			usbFrameIndex++;
+			numFramesChecked++;
+		} while (0 != --numFramesInRun);
+		//	<rdar://6094454> Use the pre-computed value of firstUSBFrameIndex and totalNumUSBFrames. 
+		//	firstUSBFrameIndex should be tied to pFrames, so it should only change when pFrames changes 
+		//	in the wrap situation. totalNumUSBFrames shouldn't change at all.
+		if (0 != numBytesToCoalesce && (usbFrameIndex + firstUSBFrameIndex) == totalNumUSBFrames)
+		{
+			pFrames = &mUSBIsocFrames[0];			// wrap around the frame list and keep trying to coalesce
+			usbFrameIndex = 0;
+			firstUSBFrameIndex = 0;					// <rdar://6094454> Start at frame# 0.
+			source = (UInt8 *)mReadBuffer;
+			//debugIOLog ("wrapping coalesce numBytesToCoalesce = %d", numBytesToCoalesce); 
+		}
+		if (((0 == numBytesToCoalesce) && (mNumTransactionsPerList == usbFrameIndex)) ||		// We've coalesced the current frame list
+			((0 != numBytesToCoalesce) && (0 >= numBytesLeft)) ||							// We've coalesced the requested number of bytes
+			((0 != numBytesToCoalesce) && (numFramesChecked >= (mNumTransactionsPerList * mNumUSBFrameLists)))) // We've gone through all the frame lists and there's nothing left to coalesce (starvation case)
+		{			
+			done = TRUE;
+#if DEBUGINPUT
+			// <rdar://problem/7378275>
+			if ( ( 0 != numBytesToCoalesce ) && ( 0 >= numBytesLeft ) )
+			{
+				UInt32 actualCount = 0;
+				while ( ( 'llit' != pFramesOnLastCopy[usbFrameIndexOnLastCopy].frStatus )			// IOUSBFamily is processing this now
+					   && ( -1 != pFramesOnLastCopy[usbFrameIndexOnLastCopy].frStatus ) )
+				{
+					actualCount += pFramesOnLastCopy[usbFrameIndexOnLastCopy].frActCount;
+					usbFrameIndexOnLastCopy++;
+					if ( ( usbFrameIndexOnLastCopy + firstUSBFrameIndexOnLastCopy ) == totalNumUSBFrames )
+					{
+						pFramesOnLastCopy = &mUSBIsocFrames[0];			// wrap around the frame list
+						usbFrameIndexOnLastCopy = 0;
+						firstUSBFrameIndexOnLastCopy = 0;					// Start at frame# 0.
+					}
+				}
+				
+				if ( actualCount > 0 )
+				{
+					numBytesMargin = actualCount - numBytesOnLastCopy;
+					debugIOLog ("! DJM03AudioStream[%p]::CoalesceInputSamples () - numBytesMargin: %lu frames: %lu\n", this, numBytesMargin, numBytesMargin/mSampleSize );
+				}
+			}
+#endif
+		}
+	}
+
+	if (!onCoreAudioThread) 
+	{
+		mBufferOffset = bufferOffset;
+	}
+
+	// Log here if we are requesting more bytes than is possible to coalesce in mNumTransactionsPerList.
+	if (		( 0 != numBytesToCoalesce )
+			&&	( numBytesLeft > 0 )
+			&&  ( NULL != mStreamInterface ) )
+	{
+		debugIOLog ("! DJM03AudioStream[%p]::CoalesceInputSamples () - Requested: %lu, Remaining: %lu on frame list %lu\n", this, numBytesToCoalesce, numBytesLeft, frameList);
+		#if LOGISOCSTATISTICS
+		OSIncrementAtomic (&mIsocStatistics.shortfalls);
+		#endif
+	}
+
+	#if DEBUGINPUT
+	debugIOLog ("- DJM03AudioStream[%p]::CoalesceInputSamples (%lu, %p)", this, numBytesToCoalesce, pFrames);
+	#endif
+	
+Exit:
+	if ( kIOReturnSuccess != result )
+	{
+		debugIOLog ( "! DJM03AudioStream[%p]::CoalesceInputSamples (%lu, %p) = 0x%x", this, numBytesToCoalesce, pFrames, result );
+	}
+	return result;
+}
+
+// Returns false while the readHandler is coalescing. Otherwise fills in the published frame list and buffer offset and
+// the sequence to check them against with isCoalescencePositionCurrent ().
+bool DJM03AudioStream::getCoalescencePosition (UInt32 * sequence, UInt32 * frameList, UInt32 * bufferOffset) {
+	UInt32							thisSequence;
+
+	thisSequence = mCoalescenceSequence;
+	if (thisSequence & 1)
+	{
+		return false;
+	}
+	OSMemoryBarrier ();
+	*frameList = mCurrentFrameList;
+	*bufferOffset = mBufferOffset;
+	*sequence = thisSequence;
+
+	return isCoalescencePositionCurrent (thisSequence);
+}
+
+// True if the readHandler hasn't started on a frame list since sequence was read. Everything read before this call
+// was read before the check.
+bool DJM03AudioStream::isCoalescencePositionCurrent (UInt32 sequence) {
+	OSMemoryBarrier ();
+	return (sequence == mCoalescenceSequence);
+}
+
+// The readHandler's side of the handoff, before it coalesces. It waits out a copy the CoreAudio thread has already
+// checked, which holds mCoalescenceCopyLock no longer than the copy takes and can't be preempted meanwhile.
+void DJM03AudioStream::beginCoalescence (void) {
+	IOSimpleLockLock (mCoalescenceCopyLock);
+	mCoalescenceSequence++;
+	OSMemoryBarrier ();
+	IOSimpleLockUnlock (mCoalescenceCopyLock);
+}
+
+// Publishes the new mCurrentFrameList and mBufferOffset.
+void DJM03AudioStream::endCoalescence (void) {
+	OSMemoryBarrier ();
+	mCoalescenceSequence++;
+}
+
+// The CoreAudio thread's side. Returns true, holding mCoalescenceCopyLock, if the position taken with sequence is still
+// current; the readHandler then can't move on before unlockCoalescencePosition (). Returns false, without waiting, if
+// the readHandler has the lock or has moved on.
+bool DJM03AudioStream::lockCoalescencePosition (UInt32 sequence) {
+	if (!IOSimpleLockTryLock (mCoalescenceCopyLock))
+	{
+		return false;
+	}
+	if (!isCoalescencePositionCurrent (sequence))
+	{
+		IOSimpleLockUnlock (mCoalescenceCopyLock);
+		return false;
+	}
+
+	return true;
+}
+
+void DJM03AudioStream::unlockCoalescencePosition (void) {
+	IOSimpleLockUnlock (mCoalescenceCopyLock);
+}
+
+#if STRESSCOALESCENCEHANDOFF
+typedef struct _StressCoalescenceState {
+	DJM03AudioStream *		stream;
+	UInt32 *				frameLists;			// two of kStressFrameListWords words
+	volatile UInt32			done;
+} StressCoalescenceState;
+
+// Runs the CoreAudio side of the handoff on this thread against the readHandler side on a thread call, for
+// kStressCoalescenceIterations frame lists. The producer fills one of two fake frame lists with the number of the step
+// and publishes it as mBufferOffset, and the next step refills the other one, the way a completion coalesces one frame
+// list while the one before it is requeued. The consumer copies the published frame list the way CoalesceInputSamples ()
+// does, and a copy that holds anything but the published number is torn. Only while the stream is not running.
+void DJM03AudioStream::stressCoalescenceHandoff (void) {
+	StressCoalescenceState			state;
+	thread_call_t					producer = NULL;
+	UInt32							copy[kStressFrameListWords];
+	UInt32							sequence;
+	UInt32							frameList;
+	UInt32							bufferOffset;
+	UInt32							word;
+	UInt32							copies = 0;
+	UInt32							retries = 0;
+	UInt32							torn = 0;
+
+	state.stream = this;
+	state.done = FALSE;
+	state.frameLists = (UInt32 *)IOMalloc (2 * kStressFrameListWords * sizeof (UInt32));
+	FailIf (NULL == state.frameLists, Exit);
+	bzero (state.frameLists, 2 * kStressFrameListWords * sizeof (UInt32));
+	mCurrentFrameList = 0;
+	mBufferOffset = 0;
+	mCoalescenceSequence = 0;
+
+	producer = thread_call_allocate ((thread_call_func_t)stressCoalescenceProducer, (thread_call_param_t)&state);
+	FailIf (NULL == producer, Exit);
+	thread_call_enter (producer);
+
+	while (!state.done)
+	{
+		if (!getCoalescencePosition (&sequence, &frameList, &bufferOffset))
+		{
+			continue;
+		}
+		if (!lockCoalescencePosition (sequence))
+		{
+			retries++;
+			continue;
+		}
+		memcpy (copy, &state.frameLists[frameList * kStressFrameListWords], sizeof (copy));
+		unlockCoalescencePosition ();
+		copies++;
+		for (word = 0; word < kStressFrameListWords; word++)
+		{
+			if (copy[word] != bufferOffset)
+			{
+				torn++;
+				break;
+			}
+		}
+	}
+	IOLog ("DJM03AudioStream[%p]::stressCoalescenceHandoff () - %lu copies, %lu retries, %lu torn\n", this, copies, retries, torn);
+
+Exit:
+	if (NULL != producer)
+	{
+		thread_call_free (producer);
+	}
+	if (NULL != state.frameLists)
+	{
+		IOFree (state.frameLists, 2 * kStressFrameListWords * sizeof (UInt32));
+	}
+	mCurrentFrameList = 0;
+	mBufferOffset = 0;
+	mCoalescenceSequence = 0;
+}
+
+// The readHandler's side of stressCoalescenceHandoff ().
+void DJM03AudioStream::stressCoalescenceProducer (thread_call_param_t param, thread_call_param_t unused) {
+	StressCoalescenceState *		state = (StressCoalescenceState *)param;
+	DJM03AudioStream *				self = state->stream;
+	UInt32							step;
+	UInt32							word;
+
+	for (step = 1; step <= kStressCoalescenceIterations; step++)
+	{
+		self->beginCoalescence ();
+		for (word = 0; word < kStressFrameListWords; word++)
+		{
+			state->frameLists[(step & 1) * kStressFrameListWords + word] = step;
+		}
+		self->mCurrentFrameList = step & 1;
+		self->mBufferOffset = step;
+		self->endCoalescence ();
+	}
+	state->done = TRUE;
+}
+#endif
+
+#if DIRECTINPUTCONVERT
+// Converts numBytesToConvert bytes of input, which belong in the sample buffer from bufferOffset on, straight from the USB
+// frame lists into destBuf. convertInputSamples uses this for samples the readHandler hasn't coalesced yet, so they aren't
+// copied into the sample buffer just to be read back out; the readHandler still coalesces them when it gets there.
+// Returns kIOReturnNotReady, with destBuf partly written, if the readHandler isn't at bufferOffset or moves on, or if the
+// frames haven't all arrived or don't hold whole sample frames. The caller then coalesces and converts as before.
+IOReturn DJM03AudioStream::ConvertInputSamplesFromFrameLists (UInt32 bufferOffset, UInt32 numBytesToConvert, void * destBuf, const IOAudioStreamFormat * streamFormat) {
+	IOReturn						result = kIOReturnNotReady;
+	IOUSBLowLatencyIsocFrame *		pFrames;
+	UInt32							sequence;
+	UInt32							frameList;
+	UInt32							currentBufferOffset;
+	UInt32							usbFrameIndex;
+	UInt32							firstUSBFrameIndex;
+	UInt32							totalNumUSBFrames;
+	UInt32							numFramesChecked;
+	UInt32							bytesPerSampleFrame;
+	UInt32							numBytesToCopy;
+	UInt8 *							source;
+	Float32 *						dest;
+
+	bytesPerSampleFrame = streamFormat->fNumChannels * (streamFormat->fBitWidth / 8);
+	FailIf (0 == bytesPerSampleFrame, Exit);
+
+	if (	(0 != streamFormat->fBitWidth % 8)
+		||	!getCoalescencePosition (&sequence, &frameList, &currentBufferOffset)
+		||	(currentBufferOffset != bufferOffset)
+		||	(0 != bufferOffset % bytesPerSampleFrame))
+	{
+		goto Exit;
+	}
+
+	pFrames = &mUSBIsocFrames[frameList * mNumTransactionsPerList];
+	source = (UInt8 *)mReadBuffer + (frameList * mReadUSBFrameListSize);
+	dest = (Float32 *)destBuf;
+	firstUSBFrameIndex = frameList * mNumTransactionsPerList;
+	totalNumUSBFrames = mNumUSBFrameLists * mNumTransactionsPerList;
+	usbFrameIndex = 0;
+	numFramesChecked = 0;
+
+	while (0 != numBytesToConvert)
+	{
+		// Leave the frames that haven't arrived, or that CoalesceInputSamples () would have to patch up, to the usual path.
+		// A packet still to be concealed would otherwise come through short here and padded in the sample buffer.
+		if (	(numFramesChecked >= totalNumUSBFrames)
+			||	('llit' == pFrames[usbFrameIndex].frStatus)
+			||	(-1 == pFrames[usbFrameIndex].frStatus)
+			||	(		(kIOReturnSuccess != pFrames[usbFrameIndex].frStatus)
+					&&	(kIOReturnUnderrun != pFrames[usbFrameIndex].frStatus))
+			||	isInputPacketToConceal (&pFrames[usbFrameIndex]))
+		{
+			goto Exit;
+		}
+		numBytesToCopy = pFrames[usbFrameIndex].frActCount;
+		if (0 != numBytesToCopy % bytesPerSampleFrame)
+		{
+			goto Exit;
+		}
+		if (numBytesToCopy > numBytesToConvert)
+		{
+			numBytesToCopy = numBytesToConvert;
+		}
+		// Past this point the readHandler may have copied the frame and requeued its frame list.
+		if (!isCoalescencePositionCurrent (sequence))
+		{
+			goto Exit;
+		}
+		if (0 != numBytesToCopy)
+		{
+			convertFromAudioInputStream_NoWrap (source, dest, 0, numBytesToCopy / bytesPerSampleFrame, streamFormat);
+			dest += (numBytesToCopy / bytesPerSampleFrame) * streamFormat->fNumChannels;
+			numBytesToConvert -= numBytesToCopy;
 		}
 
-		dest += numBytesToCopy;
 		source += pFrames[usbFrameIndex].frReqCount;
 		usbFrameIndex++;
 		numFramesChecked++;
-		//	<rdar://6094454> Use the pre-computed value of firstUSBFrameIndex and totalNumUSBFrames. 
-		//	firstUSBFrameIndex should be tied to pFrames, so it should only change when pFrames changes 
-		//	in the wrap situation. totalNumUSBFrames shouldn't change at all.
-		if (0 != numBytesToCoalesce && (usbFrameIndex + firstUSBFrameIndex) == totalNumUSBFrames)
+		if ((usbFrameIndex + firstUSBFrameIndex) == totalNumUSBFrames)
 		{
-			pFrames = &mUSBIsocFrames[0];			// wrap around the frame list and keep trying to coalesce
+			pFrames = &mUSBIsocFrames[0];
 			usbFrameIndex = 0;
-			firstUSBFrameIndex = 0;					// <rdar://6094454> Start at frame# 0.
+			firstUSBFrameIndex = 0;
 			source = (UInt8 *)mReadBuffer;
-			//debugIOLog ("wrapping coalesce numBytesToCoalesce = %d", numBytesToCoalesce); 
-		}
-		if (((0 == numBytesToCoalesce) && (mNumTransactionsPerList == usbFrameIndex)) ||		// We've coalesced the current frame list
-			((0 != numBytesToCoalesce) && (0 >= numBytesLeft)) ||							// We've coalesced the requested number of bytes
-			((0 != numBytesToCoalesce) && (numFramesChecked >= (mNumTransactionsPerList * mNumUSBFrameLists)))) // We've gone through all the frame lists and there's nothing left to coalesce (starvation case)
-		{			
-			done = TRUE;
-#if DEBUGINPUT
-			// <rdar://problem/7378275>
-			if ( ( 0 != numBytesToCoalesce ) && ( 0 >= numBytesLeft ) )
-			{
-				UInt32 actualCount = 0;
-				while ( ( 'llit' != pFramesOnLastCopy[usbFrameIndexOnLastCopy].frStatus )			// IOUSBFamily is processing this now
-					   && ( -1 != pFramesOnLastCopy[usbFrameIndexOnLastCopy].frStatus ) )
-				{
-					actualCount += pFramesOnLastCopy[usbFrameIndexOnLastCopy].frActCount;
-					usbFrameIndexOnLastCopy++;
-					if ( ( usbFrameIndexOnLastCopy + firstUSBFrameIndexOnLastCopy ) == totalNumUSBFrames )
-					{
-						pFramesOnLastCopy = &mUSBIsocFrames[0];			// wrap around the frame list
-						usbFrameIndexOnLastCopy = 0;
-						firstUSBFrameIndexOnLastCopy = 0;					// Start at frame# 0.
-					}
-				}
-				
-				if ( actualCount > 0 )
-				{
-					numBytesMargin = actualCount - numBytesOnLastCopy;
-					debugIOLog ("! DJM03AudioStream[%p]::CoalesceInputSamples () - numBytesMargin: %lu frames: %lu\n", this, numBytesMargin, numBytesMargin/mSampleSize );
-				}
-			}
-#endif
 		}
 	}
 
-	if (0 != numBytesToCoalesce) 
-	{
-		mBufferOffset = originalBufferOffset;
-	}
-
-	// Log here if we are requesting more bytes than is possible to coalesce in mNumTransactionsPerList.
-	if (		( 0 != numBytesToCoalesce )
-			&&	( numBytesLeft > 0 )
-			&&  ( NULL != mStreamInterface ) )
+	// The conversions above only count if the frames they read were still current after the last of them.
+	if (isCoalescencePositionCurrent (sequence))
 	{
-		debugIOLog ("! DJM03AudioStream[%p]::CoalesceInputSamples () - Requested: %lu, Remaining: %lu on frame list %lu\n", this, numBytesToCoalesce, numBytesLeft, mCurrentFrameList);
+		result = kIOReturnSuccess;
 	}
 
+Exit:
 	#if DEBUGINPUT
-	debugIOLog ("- DJM03AudioStream[%p]::CoalesceInputSamples (%lu, %p)", this, numBytesToCoalesce, pFrames);
+	debugIOLog ("? DJM03AudioStream[%p]::ConvertInputSamplesFromFrameLists (%lu, %lu, %p, %p) = 0x%x", this, bufferOffset, numBytesToConvert, destBuf, streamFormat, result);
 	#endif
-	
-	if (mCoalescenceMutex)
-	{
-		IORecursiveLockUnlock (mCoalescenceMutex);		// <rdar://problem/7378275>
-	}
-	
-	if ( kIOReturnSuccess != result )
-	{
-		debugIOLog ( "! DJM03AudioStream[%p]::CoalesceInputSamples (%lu, %p) = 0x%x", this, numBytesToCoalesce, pFrames, result );
-	}
 	return result;
 }
+#endif
 
 // [rdar://3918719] The following method now does the work of performFormatChange after being regulated by DJM03AudioDevice::formatChangeController().
 IOReturn DJM03AudioStream::controlledFormatChange (const IOAudioStreamFormat *newFormat, const IOAudioSampleRate *newSampleRate)
@@ -1254,8 +2095,17 @@ IOReturn DJM03AudioStream::controlledFormatChange (const IOAudioStreamFormat *ne
 	debugIOLog ("? DJM03AudioStream[%p]::controlledFormatChange () - averageFrameSamples = %d", this, averageFrameSamples);
 
 	mSampleBitWidth = newFormat->fBitWidth;
+	if (mNumChannels != newFormat->fNumChannels)
+	{
+		// The channel map is only meaningful for the channel count it was made for.
+		mChannelMapActive = false;
+		removeProperty (kChannelMapKey);
+	}
 	mNumChannels =  newFormat->fNumChannels;
+	InitClipMeterState (&mMeterState, (mMeteringEnabled && (mNumChannels <= kClipMeterMaxChannels)) ? mNumChannels : 0);
 	mSampleSize = newFormat->fNumChannels * (newFormat->fBitWidth / 8);
+	mFloatFormat = (kIOAudioStreamNumericRepresentationIEEE754Float == newFormat->fNumericRepresentation);
+	InitClipDitherState (&mDitherState, mDitherState.mode);
 	mAverageFrameSize = averageFrameSamples * mSampleSize;
 	mAlternateFrameSize = (averageFrameSamples + 1) * mSampleSize;
 	debugIOLog ("? DJM03AudioStream[%p]::controlledFormatChange () - mAverageFrameSize = %d, mAlternateFrameSize = %d", this, mAverageFrameSize, mAlternateFrameSize);
@@ -1411,11 +2261,19 @@ void DJM03AudioStream::updateSampleOffsetAndLatency ()
 	OSDictionary *						sampleLatencyDictionary = NULL;
 	UInt32								newSampleOffset;
 	UInt32								newSampleLatency;	
+	UInt32								extraSampleOffset;
 
 	// <rdar://problem/7378275>
 	averageFrameSamples = mCurSampleRate.whole / 1000; // per ms
 	additionalSampleFrameFreq = mCurSampleRate.whole - ( averageFrameSamples * 1000 );
 
+	// The latency profile's margin, and the lateness of the completions, go on top of the offset in both directions, after
+	// any override from the vendor specific kext.
+	extraSampleOffset = kLatencyProfiles[mLatencyProfile].extraSafetyOffset * averageFrameSamples;
+	#if ADAPTIVEQUEUEDEPTH
+	extraSampleOffset += mCompletionLateness * averageFrameSamples;
+	#endif
+
 	if (kUSBIn == mDirection) 
 	{
 		// Check to see if latency should be higher for EHCI (rdar://3959606 ) 
@@ -1470,6 +2328,7 @@ void DJM03AudioStream::updateSampleOffsetAndLatency ()
 		//ここまで補正すると、ノイズが出ない
 		//newSampleOffset = 96;
 		if( newSampleOffset<96 ) newSampleOffset = 96;
+		newSampleOffset += extraSampleOffset;
 //IOLog("Input newSampleOffset=%d\n",newSampleOffset);
 		
 		// Set the offset for input devices (microphones, etc.)
@@ -1532,11 +2391,12 @@ void DJM03AudioStream::updateSampleOffsetAndLatency ()
 				newSampleOffset = sampleOffset->unsigned32BitValue ();
 			}
 		}
+		newSampleOffset += extraSampleOffset;
 
 		// Set the offset for output devices (speakers, etc.) to 1 USB frame (+1 ms to latency). This is necessary to ensure that samples are not clipped 
 		// to a portion of the buffer whose DMA is in process.
-//IOLog("Output newSampleOffset=%d\n",minimumSafeSampleOffset);
-		mUSBAudioEngine->setOutputSampleOffset (minimumSafeSampleOffset);
+//IOLog("Output newSampleOffset=%d\n",newSampleOffset);
+		mUSBAudioEngine->setOutputSampleOffset (newSampleOffset);
 		debugIOLog ("? DJM03AudioEngine[%p]::updateSampleOffsetAndLatency () - setting output sample offset to %lu sample frames", this, newSampleOffset);
 		
 		newSampleLatency = additionalSampleFrameFreq ? averageFrameSamples + 1 : averageFrameSamples;
@@ -1968,6 +2828,7 @@ Exit:
 bool DJM03AudioStream::configureAudioStream (IOAudioSampleRate sampleRate) {
 	OSNumber *							idVendor = NULL;
 	OSNumber *							idProduct = NULL;
+	OSNumber *							number;
 	DJM03ConfigurationDictionary *		configDictionary;
 //	UInt8								deviceClass;
 //	UInt8								deviceSubclass;
@@ -1989,7 +2850,6 @@ bool DJM03AudioStream::configureAudioStream (IOAudioSampleRate sampleRate) {
 
     resultBool = FALSE;
 	mTerminatingDriver = FALSE;
-	mCoalescenceMutex = NULL;
 
 	FailIf (NULL == mUSBAudioDevice, Exit);							// <rdar://7085810>
 	FailIf (NULL == mUSBAudioDevice->mControlInterface, Exit);		// <rdar://7085810>
@@ -2007,13 +2867,15 @@ bool DJM03AudioStream::configureAudioStream (IOAudioSampleRate sampleRate) {
 			resultCode = configDictionary->getIndexedInputTerminalType (&terminalType, mUSBAudioDevice->mControlInterface->GetInterfaceNumber (), 0, index++);
 		} while (terminalType == INPUT_UNDEFINED && index < 256 && kIOReturnSuccess == resultCode);
 
-		mNumUSBFrameLists = RECORD_NUM_USB_FRAME_LISTS;
-		mNumUSBFramesPerList = RECORD_NUM_USB_FRAMES_PER_LIST;
-		mNumUSBFrameListsToQueue = RECORD_NUM_USB_FRAME_LISTS_TO_QUEUE;
-		
-		// We need a mutex for CoalesceInputSamples () in case something goes wrong at the start of the stream.
-		mCoalescenceMutex = IORecursiveLockAlloc ();
-		FailIf (NULL == mCoalescenceMutex, Exit);
+		mCoalescenceSequence = 0;
+		if (NULL == mCoalescenceCopyLock)
+		{
+			mCoalescenceCopyLock = IOSimpleLockAlloc ();
+			FailIf (NULL == mCoalescenceCopyLock, Exit);
+		}
+		#if STRESSCOALESCENCEHANDOFF
+		stressCoalescenceHandoff ();
+		#endif
 	} 
 	else if (kUSBOut == mDirection) 
 	{
@@ -2024,14 +2886,16 @@ bool DJM03AudioStream::configureAudioStream (IOAudioSampleRate sampleRate) {
 			resultCode = configDictionary->getIndexedOutputTerminalType (&terminalType, mUSBAudioDevice->mControlInterface->GetInterfaceNumber (), 0, index++);
 		} while (terminalType == OUTPUT_UNDEFINED && index < 256 && kIOReturnSuccess == resultCode);
 
-		mNumUSBFrameLists = PLAY_NUM_USB_FRAME_LISTS;
-		mNumUSBFramesPerList = PLAY_NUM_USB_FRAMES_PER_LIST;
-		mNumUSBFrameListsToQueue = PLAY_NUM_USB_FRAME_LISTS_TO_QUEUE;
 	} 
 	else 
 	{
 		FailIf ("Couldn't get the endpoint direction!", Exit);
 	}
+
+	number = OSDynamicCast (OSNumber, mStreamInterface->getProperty (kLatencyProfileKey));
+	mLatencyProfile = ((NULL != number) && (number->unsigned32BitValue () < kLatencyProfileCount)) ? number->unsigned32BitValue () : kLatencyProfileBalanced;
+	setProperty (kLatencyProfileKey, mLatencyProfile, 32);
+	applyLatencyProfile ();
 	
 	// See if UHCI support is necessary
 	mUHCISupport = mUSBAudioDevice->checkForUHCI ();
@@ -2055,8 +2919,10 @@ bool DJM03AudioStream::configureAudioStream (IOAudioSampleRate sampleRate) {
 	bzero (mSampleBufferDescriptors, mNumUSBFrameLists * sizeof (IOSubMemoryDescriptor *));
 	mWrapDescriptors[0] = OSTypeAlloc (IOSubMemoryDescriptor);
 	mWrapDescriptors[1] = OSTypeAlloc (IOSubMemoryDescriptor);
+	mWrapRangeDescriptor = OSTypeAlloc (IOMultiMemoryDescriptor);		// bound to mWrapDescriptors by PrepareWriteFrameList ()
 	FailIf (NULL == mWrapDescriptors[0], Exit);
 	FailIf (NULL == mWrapDescriptors[1], Exit);
+	FailIf (NULL == mWrapRangeDescriptor, Exit);
 	FailIf (NULL == mUSBCompletion, Exit);
 	FailIf (NULL == mSampleBufferDescriptors, Exit);
 
@@ -2067,7 +2933,7 @@ bool DJM03AudioStream::configureAudioStream (IOAudioSampleRate sampleRate) {
 	// Tell the IOAudioFamily what format we are going to be running in.
 	// <rdar://problem/6892754> 10.5.7 Regression: Devices with unsupported formats stopped working
 	FailIf ( kIOReturnSuccess != configDictionary->getFormat ( &format, mInterfaceNumber, mAlternateSettingID ), Exit );
-	if ( ( PCM == format ) || ( IEC1937_AC3 == format ) )
+	if ( ( PCM == format ) || ( IEEE_FLOAT == format ) || ( IEC1937_AC3 == format ) )
 	{
 		FailIf (kIOReturnSuccess != configDictionary->getNumChannels (&numChannels, mInterfaceNumber, mAlternateSettingID), Exit);
 		streamFormat.fNumChannels = numChannels;
@@ -2086,6 +2952,11 @@ bool DJM03AudioStream::configureAudioStream (IOAudioSampleRate sampleRate) {
 			streamFormat.fNumericRepresentation = kIOAudioStreamNumericRepresentationSignedInt;
 			streamFormat.fIsMixable = TRUE;
 			break;
+		case IEEE_FLOAT:	// Float32 samples go between the mix buffer and the device as they are
+			streamFormat.fSampleFormat = kIOAudioStreamSampleFormatLinearPCM;
+			streamFormat.fNumericRepresentation = kIOAudioStreamNumericRepresentationIEEE754Float;
+			streamFormat.fIsMixable = TRUE;
+			break;
 		case AC3:	// just starting to stub something in for AC-3 support
 			streamFormat.fSampleFormat = kIOAudioStreamSampleFormatAC3;
 			streamFormat.fNumericRepresentation = kIOAudioStreamNumericRepresentationSignedInt;
@@ -2173,12 +3044,13 @@ void DJM03AudioStream::queueInputFrames () {
 
 		if ( framesLeftInQueue < ( mNumUSBFramesPerList * ( mNumUSBFrameListsToQueue / 2 )) / 2 ) 	// <rdar://problem/6327095>
 		{
-			while ( framesLeftInQueue < mNumUSBFramesPerList * ( mNumUSBFrameListsToQueue - 1 ) && 0 == mShouldStop ) 
+			// Drop out once the USB completion holds mInCompletion, or this would spin against it on the same CPU.
+			while ( framesLeftInQueue < mNumUSBFramesPerList * ( mNumUSBFrameListsToQueue - 1 ) && 0 == mShouldStop && TRUE != mInCompletion ) 
 			{
 				#if DEBUGLOADING
 				debugIOLog ("! DJM03AudioEngine::convertInputSamples () - Queue a read from convertInputSamples: framesLeftInQueue = %ld", (UInt32)framesLeftInQueue);
 				#endif
-				readHandler (this, mUSBCompletion[mCurrentFrameList].parameter, kIOReturnSuccess, &mUSBIsocFrames[mCurrentFrameList * mNumUSBFramesPerList]);
+				readHandler (this, kQueuedInputFrameListParameter, kIOReturnSuccess, &mUSBIsocFrames[mCurrentFrameList * mNumTransactionsPerList]);
 
 				curUSBFrameNumber = mStreamInterface->GetDevice()->GetBus()->GetFrameNumber ();
 				framesLeftInQueue = mUSBFrameToQueue - curUSBFrameNumber;
@@ -2220,6 +3092,59 @@ void DJM03AudioStream::initializeUSBFrameList ( IOUSBLowLatencyIsocFrame * usbIs
 	}
 }
 
+// Runs the fractional accumulator PrepareWriteFrameList would otherwise run for every transaction once, from
+// mFractionalSamplesLeft, until it comes back to where it started. A synchronous or adaptive rate comes back within a
+// few dozen transactions (80 at 44.1 kHz and 8 transactions per ms), a rate from the feedback endpoint may take too
+// long for the table.
+void DJM03AudioStream::buildPacketCadence (void)
+{
+	UInt32								fraction;
+	UInt32								length;
+	UInt32								divisor;
+
+	mPacketCadenceSamplesPerPacket = mSamplesPerPacket;
+	mPacketCadenceStartFraction = mFractionalSamplesLeft;
+	mPacketCadenceIndex = 0;
+	mPacketCadenceLength = 0;
+
+	// The cycle is rollover / gcd (fraction, rollover) long. Don't walk a rate from the feedback endpoint that won't fit.
+	fraction = mSamplesPerPacket.fraction;
+	divisor = kSampleFractionAccumulatorRollover;
+	while (0 != fraction)
+	{
+		length = divisor % fraction;
+		divisor = fraction;
+		fraction = length;
+	}
+	if ((kSampleFractionAccumulatorRollover) / divisor > kMaxPacketCadenceLength)
+	{
+		goto Exit;
+	}
+
+	fraction = mFractionalSamplesLeft;
+	for (length = 0; length < kMaxPacketCadenceLength; length++)
+	{
+		mPacketCadence[length] = mSamplesPerPacket.whole;
+		fraction += mSamplesPerPacket.fraction;
+		if (fraction >= kSampleFractionAccumulatorRollover)
+		{
+			mPacketCadence[length]++;
+			fraction -= kSampleFractionAccumulatorRollover;
+		}
+		if (fraction == mPacketCadenceStartFraction)
+		{
+			mPacketCadenceLength = length + 1;
+			break;
+		}
+	}
+
+Exit:
+	#if SHOWCADENCE
+	debugIOLog ("? DJM03AudioStream[%p]::buildPacketCadence () - %lu(whole) %lu(fraction) repeats every %lu transactions", this, mSamplesPerPacket.whole, mSamplesPerPacket.fraction, mPacketCadenceLength);
+	#endif
+	return;
+}
+
 IOReturn DJM03AudioStream::PrepareWriteFrameList (UInt32 arrayIndex) {
 	const IOAudioStreamFormat *			theFormat;
 	IOReturn							result;
@@ -2236,8 +3161,6 @@ IOReturn DJM03AudioStream::PrepareWriteFrameList (UInt32 arrayIndex) {
 	UInt16								integerSamplesInFrame;
 	UInt16								averageSamplesInFrame;
 	UInt16								bytesAfterWrap = 0;			// for UHCI support
-	UInt8								transactionsPerMS;
-	UInt8								powerOfTwo = 0;
 	Boolean								haveWrapped;
 
 	result = kIOReturnError;		// assume failure
@@ -2257,27 +3180,43 @@ IOReturn DJM03AudioStream::PrepareWriteFrameList (UInt32 arrayIndex) {
 		frameListByteCount = 0;
 	#endif
 	
-	
-	transactionsPerMS = mTransactionsPerUSBFrame;
-	while ( transactionsPerMS > 1 )
+
+	// The feedback endpoint may have changed the rate since the cadence table was built. Carry the accumulator on from
+	// where the old table left it.
+	if	(		(mPacketCadenceSamplesPerPacket.whole != mSamplesPerPacket.whole)
+			||	(mPacketCadenceSamplesPerPacket.fraction != mSamplesPerPacket.fraction))
 	{
-		transactionsPerMS >>= 1;
-		powerOfTwo++;
-	}	 
-	
+		if (0 != mPacketCadenceLength)
+		{
+			mFractionalSamplesLeft = (UInt32)(((UInt64)mPacketCadenceIndex * mPacketCadenceSamplesPerPacket.fraction + mPacketCadenceStartFraction) % (kSampleFractionAccumulatorRollover));
+		}
+		buildPacketCadence ();
+	}
+
 	// <rdar://problems/5600254> Calculate the sample rate in terms of transactions instead of milliseconds. For full speed devices, this changes nothing.
 	// <rdar://problems/6954295> Store Async feedback in samples per frame/microframe as a 16.16 fixed point number
 	averageSamplesInFrame = mSamplesPerPacket.whole;
 	remainderedSamples = mSamplesPerPacket.fraction;
 	for (numTransactionsPrepared = 0; numTransactionsPrepared < mNumTransactionsPerList; numTransactionsPrepared++) 
 	{
-		// [rdar://5600254] Remaindered samples are to be determined on a transaction basis, not a USB frame basis.		
-		integerSamplesInFrame = averageSamplesInFrame;
-		mFractionalSamplesLeft += remainderedSamples;
-		if ( mFractionalSamplesLeft >= kSampleFractionAccumulatorRollover ) 	// <rdar://problem/6954295>
+		if (0 != mPacketCadenceLength)
+		{
+			integerSamplesInFrame = mPacketCadence[mPacketCadenceIndex];
+			if (++mPacketCadenceIndex == mPacketCadenceLength)
+			{
+				mPacketCadenceIndex = 0;
+			}
+		}
+		else
 		{
-			integerSamplesInFrame++;
-			mFractionalSamplesLeft -= kSampleFractionAccumulatorRollover;		// <rdar://problem/6954295>
+			// [rdar://5600254] Remaindered samples are to be determined on a transaction basis, not a USB frame basis.		
+			integerSamplesInFrame = averageSamplesInFrame;
+			mFractionalSamplesLeft += remainderedSamples;
+			if ( mFractionalSamplesLeft >= kSampleFractionAccumulatorRollover ) 	// <rdar://problem/6954295>
+			{
+				integerSamplesInFrame++;
+				mFractionalSamplesLeft -= kSampleFractionAccumulatorRollover;		// <rdar://problem/6954295>
+			}
 		}
 		thisFrameSize = integerSamplesInFrame * mSampleSize;
 		#if DEBUGLATENCY
@@ -2355,13 +3294,9 @@ IOReturn DJM03AudioStream::PrepareWriteFrameList (UInt32 arrayIndex) {
 		{
 			mWrapDescriptors[1]->initSubRange (mUSBBufferDescriptor, 0, lastPreparedByte, kIODirectionOut);
 
-			if (NULL != mWrapRangeDescriptor) 
-			{
-				mWrapRangeDescriptor->release ();
-				mWrapRangeDescriptor = NULL;
-			}
-
-			mWrapRangeDescriptor = IOMultiMemoryDescriptor::withDescriptors ((IOMemoryDescriptor **)mWrapDescriptors, 2, kIODirectionOut, true);
+			// Rebind rather than allocate on the output path. The write that used it last finished long ago, since the
+			// sample buffer holds far more than the frame lists that are queued at once.
+			FailIf (false == mWrapRangeDescriptor->initWithDescriptors ((IOMemoryDescriptor **)mWrapDescriptors, 2, kIODirectionOut, true), Exit);
 		}
 	} 
 	else 
@@ -2540,19 +3475,39 @@ IOReturn DJM03AudioStream::readFrameList (UInt32 frameListNum) {
 void DJM03AudioStream::readHandler (void * object, void * parameter, IOReturn result, IOUSBLowLatencyIsocFrame * pFrames) {
 	DJM03AudioStream *			self;
 	UInt64							currentUSBFrameNumber;
+	SInt64							framesQueued;
 	UInt32							frameListToRead;
+	UInt32							numFrameListsToRead;
 	UInt32							thisActCount = 0;
 	UInt32							minimumUSBFrameSize = 0;
 	UInt8							frameIndex;
 	IOReturn						thisStatus = 0;
 	bool							flagOverrun;
+	#if LOGISOCSTATISTICS
+	UInt64							startTime;
+
+	clock_get_uptime (&startTime);
+	#endif
 
 	#if DEBUGINPUT
 	debugIOLog ("+ DJM03AudioStream::readHandler ()");
 	#endif
 	self = (DJM03AudioStream *)object;
-	FailIf (TRUE == self->mInCompletion, Exit);
-	self->mInCompletion = TRUE;
+	// queueInputFrames () calls this on the CoreAudio thread as well; only one caller at a time gets to coalesce.
+	if (!OSCompareAndSwap (FALSE, TRUE, &self->mInCompletion))
+	{
+		debugIOLog ("! DJM03AudioStream::readHandler () - Already in completion");
+		return;
+	}
+	#if SIMULATEISOCFAULTS
+	// Only the USB completion of the frame list about to be coalesced gets faults, so they land on the same packets
+	// every run. queueInputFrames () can get to a list while its packets are still arriving.
+	if ((kIOReturnAborted != result) && ((UInt32)(uintptr_t)parameter == self->mCurrentFrameList))
+	{
+		self->simulateIsocFaults (pFrames, self->mNumTransactionsPerList);
+		self->simulateHostJitter (&self->mSimulatedFaultState);
+	}
+	#endif
 
 	if	(		(self->mUSBAudioDevice)
 			&&	(false == self->mUSBAudioDevice->getSingleSampleRateDevice ())		// We didn't know this was a single sample rate device at this time
@@ -2588,6 +3543,7 @@ void DJM03AudioStream::readHandler (void * object, void * parameter, IOReturn re
 
 	FailIf (NULL == self->mStreamInterface, Exit);
 	currentUSBFrameNumber = self->mStreamInterface->GetDevice()->GetBus()->GetFrameNumber();
+	framesQueued = (SInt64)(self->mUSBFrameToQueue - currentUSBFrameNumber);
 	
 	if (kIOReturnAborted != result)
 	{
@@ -2623,7 +3579,16 @@ void DJM03AudioStream::readHandler (void * object, void * parameter, IOReturn re
 			if (thisActCount < minimumUSBFrameSize)
 			{
 				// IOLog ("DJM03Audio: ERROR on input! Short packet of size %lu encountered when %lu bytes were requested.\n", thisActCount, (pFrames + frameIndex)->frReqCount);
+				#if LOGISOCSTATISTICS
+				self->mIsocStatistics.shortPackets++;
+				#endif
+			}
+			#if LOGISOCSTATISTICS
+			if ((kIOReturnSuccess != thisStatus) && (kIOReturnUnderrun != thisStatus))
+			{
+				self->mIsocStatistics.errorPackets++;
 			}
+			#endif
 			
 			if (kIOReturnNotResponding == thisStatus)
 			{
@@ -2646,6 +3611,9 @@ void DJM03AudioStream::readHandler (void * object, void * parameter, IOReturn re
 		}
 	}
 
+	// Consumers on the CoreAudio thread wait, or start over, while the sequence is odd.
+	self->beginCoalescence ();
+
 	if (kIOReturnAborted != result) 
 	{
 		self->CoalesceInputSamples (0, pFrames);
@@ -2663,13 +3631,6 @@ void DJM03AudioStream::readHandler (void * object, void * parameter, IOReturn re
 	} 
 	else if (kIOReturnAborted != result)
 	{
-		// <rdar://7568547> Acquire the lock when updating the mCurrentFrameList value so that it is 
-		// consistent when accessed in CoalesceInputSamples().
-		if (self->mCoalescenceMutex)
-		{
-			IORecursiveLockLock (self->mCoalescenceMutex);
-		}
-		
 		if (self->mCurrentFrameList == self->mNumUSBFrameLists - 1) 
 		{
 			self->mCurrentFrameList = 0;
@@ -2679,19 +3640,31 @@ void DJM03AudioStream::readHandler (void * object, void * parameter, IOReturn re
 			self->mCurrentFrameList++;
 		}
 
-		// <rdar://7568547> Release the lock.
-		if (self->mCoalescenceMutex)
+		#if ADAPTIVEQUEUEDEPTH
+		numFrameListsToRead = self->adaptQueueDepth (framesQueued);
+		#else
+		numFrameListsToRead = 1;
+		#endif
+		for (; numFrameListsToRead > 0; numFrameListsToRead--)
 		{
-			IORecursiveLockUnlock (self->mCoalescenceMutex);
+			frameListToRead = (self->mCurrentFrameList - 1) + self->mNumUSBFrameListsToQueue - (numFrameListsToRead - 1);
+			if (frameListToRead >= self->mNumUSBFrameLists) 
+			{
+				frameListToRead -= self->mNumUSBFrameLists;
+			}
+			self->readFrameList (frameListToRead);
 		}
+	}
 
-		frameListToRead = (self->mCurrentFrameList - 1) + self->mNumUSBFrameListsToQueue;
-		if (frameListToRead >= self->mNumUSBFrameLists) 
-		{
-			frameListToRead -= self->mNumUSBFrameLists;
-		}
-		self->readFrameList (frameListToRead);
+	// Publish the new mCurrentFrameList and mBufferOffset.
+	self->endCoalescence ();
+
+	#if LOGISOCSTATISTICS
+	if (kIOReturnAborted != result)
+	{
+		self->updateIsocStatistics (startTime, self->mNumUSBFramesPerList);
 	}
+	#endif
 
 Exit:
 	self->mInCompletion = FALSE;
@@ -2787,8 +3760,13 @@ void DJM03AudioStream::sampleRateHandler (void * target, void * parameter, IORet
 				newSamplesPerFrame.fraction = 0;
 		}
 		// <rdar://problem/6954295>
+		#if FEEDBACKPLL
+		// The loop has to see every value, not just the ones that differ from the current rate.
+		if ( newSamplesPerFrame.whole != 0 ) 
+		#else
 		if (  ( newSamplesPerFrame.whole != 0 ) && 
 			  ( newSamplesPerFrame.whole != oldSamplesPerFrame.whole || newSamplesPerFrame.fraction != oldSamplesPerFrame.fraction ) ) 
+		#endif
 		{
 			// Need to make sure this sample rate isn't way out of the ballpark 
 			// i.e. each frame/microframe cannot vary by more than +/- one sample <rdar://problem/6954295>
@@ -2800,7 +3778,11 @@ void DJM03AudioStream::sampleRateHandler (void * target, void * parameter, IORet
 			else
 			{
 				// The device has changed the sample rate that it needs, let's roll with the new sample rate <rdar://problem/6954295>
+				#if FEEDBACKPLL
+				self->updateFeedbackPLL (newSamplesPerFrame);
+				#else
 				self->mSamplesPerPacket = newSamplesPerFrame;
+				#endif
 #if DEBUGSAMPLERATEHANDLER
 				debugIOLog ("? DJM03AudioStream::sampleRateHandler () - Sample rate changed, requestedFrameRate: %u mSamplesPerPacket: %lu %lu\n", self->getRateFromSamplesPerPacket ( self->mSamplesPerPacket ), self->mSamplesPerPacket.whole, self->mSamplesPerPacket.fraction );
 #endif
@@ -2855,6 +3837,9 @@ void DJM03AudioStream::sampleRateHandler (void * target, void * parameter, IORet
 				}
 			}
 			
+			#if FEEDBACKPLL
+			self->mFeedbackFrames = framesToAdvance;
+			#endif
 			if ( kIOReturnSuccess != readStatus )
 			{
 				debugIOLog ( "! DJM03AudioStream::sampleRateHandler () - Could not queue feedback endpoint isoc request. Feedback request chain is halted!" );
@@ -2871,6 +3856,36 @@ void DJM03AudioStream::sampleRateHandler (void * target, void * parameter, IORet
 	return;
 }
 
+#if FEEDBACKPLL
+// Tracks both the rate the device asks for and the samples that fell behind or ran ahead of it while the loop was
+// catching up, so the FIFO in the device ends up where it started. The gains are 2n/tau and n/tau^2 for n USB frames
+// between feedback values, which is critically damped for n well below tau.
+void DJM03AudioStream::updateFeedbackPLL (IOAudioSamplesPerFrame requestedSamplesPerFrame)
+{
+	SInt64							requestedRate;
+	SInt64							rateError;
+	SInt64							frames;
+
+	requestedRate = (SInt64)requestedSamplesPerFrame.whole * (kSampleFractionAccumulatorRollover) + requestedSamplesPerFrame.fraction;
+	if (!mFeedbackLocked)
+	{
+		// Start out at the device's rate rather than pull in from the nominal one.
+		mFeedbackRate = requestedRate;
+		mFeedbackPhaseError = 0;
+		mFeedbackLocked = true;
+	}
+	else
+	{
+		frames = (mFeedbackFrames < (1 << (kFeedbackPLLTimeConstantShift - 2))) ? mFeedbackFrames : (1 << (kFeedbackPLLTimeConstantShift - 2));
+		rateError = requestedRate - (SInt64)mFeedbackRate;
+		mFeedbackPhaseError += rateError * frames;
+		mFeedbackRate += (2 * rateError * frames) / (1ll << kFeedbackPLLTimeConstantShift) + (mFeedbackPhaseError * frames) / (1ll << (2 * kFeedbackPLLTimeConstantShift));
+	}
+	mSamplesPerPacket.whole = mFeedbackRate / (kSampleFractionAccumulatorRollover);
+	mSamplesPerPacket.fraction = mFeedbackRate % (kSampleFractionAccumulatorRollover);
+}
+#endif
+
 IOReturn DJM03AudioStream::setSampleRateControl (UInt8 address, UInt32 sampleRate) {
 	IOUSBDevRequest				devReq;
 	UInt32						theSampleRate;
@@ -2990,6 +4005,26 @@ IOReturn DJM03AudioStream::prepareUSBStream () {
 	mFractionalSamplesLeft = 0;			// Reset our parital frame list info
 	
 	mOverrunsCount = 0;
+	mConsecutiveOverruns = 0;
+	mConcealedPackets = 0;
+	mNumUSBFrameListsToQueue = mMaxNumUSBFrameListsToQueue;
+	#if FEEDBACKPLL
+	mFeedbackLocked = false;
+	#endif
+	#if ADAPTIVEQUEUEDEPTH
+	mQueueDepthFrames = 0;
+	mQueueDepthHoldoff = 1;
+	mQueueDepthMinMargin = 0x7FFFFFFF;
+	mQueueDepthChanged = (0 != mCompletionLateness);
+	mCompletionLateness = 0;
+	#endif
+	#if SIMULATEISOCFAULTS
+	mSimulatedFaultState = kSimulatedFaultSeed;
+	mSimulatedJitterState = kSimulatedFaultSeed;
+	#endif
+	#if LOGISOCSTATISTICS
+	bzero (&mIsocStatistics, sizeof (mIsocStatistics));
+	#endif
 
     mShouldStop = 0;
 	
@@ -3000,6 +4035,10 @@ IOReturn DJM03AudioStream::prepareUSBStream () {
 	remainder = mCurSampleRate.whole - ( mSamplesPerPacket.whole * mTransactionsPerUSBFrame * 1000 );	// same as (mCurSampleRate.whole % 1000) * mTransactionsPerUSBFrame
 	mSamplesPerPacket.fraction = ( remainder * 65536 ) / mTransactionsPerUSBFrame;
 	debugIOLog ( "? DJM03AudioStream[%p]::prepareUSBStream () - mSamplesPerPacket: %u(whole) %u(fraction)", this, mSamplesPerPacket.whole, mSamplesPerPacket.fraction );
+	if (kUSBOut == mDirection)
+	{
+		buildPacketCadence ();
+	}
 	
     FailIf ((mNumUSBFrameLists < mNumUSBFrameListsToQueue), Exit);
 	FailIf (NULL == (configDictionary = mUSBAudioDevice->getConfigDictionary()), Exit);
@@ -3035,12 +4074,12 @@ IOReturn DJM03AudioStream::prepareUSBStream () {
 	FailIf (NULL == mPipe, Exit);
     mPipe->retain ();
 
-/*	if (getDirection () == kIOAudioStreamDirectionOutput) 
+	if (getDirection () == kIOAudioStreamDirectionOutput) 
 	{
 		// Not concerned with errors in this function at this time.
 		(void)checkForFeedbackEndpoint ( configDictionary );
 	}
-*/
+
 	calculateSamplesPerPacket (mCurSampleRate.whole, &averageFrameSamples, &additionalSampleFrameFreq);
 	theFormat = this->getFormat ();
 	// [rdar://4664738] Check the maximum packet size of the isoc data endpoint.
@@ -3380,6 +4419,7 @@ void DJM03AudioStream::writeHandler (void * object, void * parameter, IOReturn r
 	UInt64					time;
     UInt64                  curUSBFrameNumber;
     UInt32                  frameListToWrite;
+    UInt32                  numFrameListsToWrite;
     UInt32                  byteOffset;
 	UInt32                  frameIndex;
     UInt32                  byteCount;
@@ -3387,15 +4427,23 @@ void DJM03AudioStream::writeHandler (void * object, void * parameter, IOReturn r
 	UInt32					numberOfFramesToCheck;
     SInt64                  frameDifference;
     SInt32                  expectedFrames;
+	#if LOGISOCSTATISTICS
+	UInt64					startTime;
+
+	clock_get_uptime (&startTime);
+	#endif
 
     self = (DJM03AudioStream *)object;
     FailIf (TRUE == self->mInCompletion, Exit);
     self->mInCompletion = TRUE;
     FailIf (NULL == self->mStreamInterface, Exit);
+	#if SIMULATEISOCFAULTS
+	self->simulateHostJitter (&self->mSimulatedFaultState);
+	#endif
 
     curUSBFrameNumber = self->mStreamInterface->GetDevice()->GetBus()->GetFrameNumber ();
     frameDifference = (SInt64)(self->mUSBFrameToQueue - curUSBFrameNumber);
-    expectedFrames = (SInt32)(self->mNumUSBFramesPerList * (self->mNumUSBFrameListsToQueue / 2)) + 1;
+    expectedFrames = (SInt32)(self->mNumUSBFramesPerList * (self->mNumUSBFrameListsToQueue - 1)) + 1;
 	numberOfFramesToCheck = 0;
 	
 	#if DEBUGUHCI
@@ -3505,15 +4553,37 @@ void DJM03AudioStream::writeHandler (void * object, void * parameter, IOReturn r
 	} 
     else 
     {
-		// Queue another write
-        frameListToWrite = (self->mCurrentFrameList - 1) + self->mNumUSBFrameListsToQueue;
-        if (frameListToWrite >= self->mNumUSBFrameLists) 
-        {
-            frameListToWrite -= self->mNumUSBFrameLists;
-        }
-        self->writeFrameList (frameListToWrite);
+		// Queue another write, or none or two if the queue depth changes. UHCI wrap writes stay at a fixed depth.
+		#if ADAPTIVEQUEUEDEPTH
+		numFrameListsToWrite = self->mUHCISupport ? 1 : self->adaptQueueDepth (frameDifference);
+		#else
+		numFrameListsToWrite = 1;
+		#endif
+		for (; numFrameListsToWrite > 0; numFrameListsToWrite--)
+		{
+			frameListToWrite = (self->mCurrentFrameList - 1) + self->mNumUSBFrameListsToQueue - (numFrameListsToWrite - 1);
+			if (frameListToWrite >= self->mNumUSBFrameLists) 
+			{
+				frameListToWrite -= self->mNumUSBFrameLists;
+			}
+			self->writeFrameList (frameListToWrite);
+		}
     }
 
+	#if LOGISOCSTATISTICS
+	if (kIOReturnAborted != result)
+	{
+		for (frameIndex = 0; frameIndex < numberOfFramesToCheck && pFrames; frameIndex++)
+		{
+			if ((kIOReturnSuccess != pFrames[frameIndex].frStatus) && (kIOReturnUnderrun != pFrames[frameIndex].frStatus))
+			{
+				self->mIsocStatistics.errorPackets++;
+			}
+		}
+		self->updateIsocStatistics (startTime, self->mNumUSBFramesPerList);
+	}
+	#endif
+
 Exit:
     self->mInCompletion = FALSE;
     return;
@@ -3534,7 +4604,7 @@ void DJM03AudioStream::writeHandlerForUHCI (void * object, void * parameter, IOR
 
     curUSBFrameNumber = self->mStreamInterface->GetDevice()->GetBus()->GetFrameNumber ();
     frameDifference = (SInt64)(self->mUSBFrameToQueue - curUSBFrameNumber);
-    expectedFrames = (SInt32)(self->mNumUSBFramesPerList * (self->mNumUSBFrameListsToQueue / 2)) + 1;
+    expectedFrames = (SInt32)(self->mNumUSBFramesPerList * (self->mNumUSBFrameListsToQueue - 1)) + 1;
 	numberOfFramesToCheck = 0;
 	
 	#if DEBUGUHCI
@@ -3628,6 +4698,136 @@ void DJM03AudioStream::takeTimeStamp (bool incrementLoopCount, UInt64 *timestamp
 	}
 }
 
+#if ADAPTIVEQUEUEDEPTH
+// Called by the isoc completions right before they queue the next frame list, with the number of USB frames still
+// queued ahead of the bus, which is zero or less if the stream fell behind. Returns how many frame lists to queue: none
+// takes one off the queue, two puts one back.
+UInt32 DJM03AudioStream::adaptQueueDepth (SInt64 framesQueued)
+{
+	SInt32							lateness;
+	UInt32							numFrameListsToQueue = 1;
+
+	if (framesQueued < mQueueDepthMinMargin)
+	{
+		mQueueDepthMinMargin = (SInt32)framesQueued;
+	}
+	mQueueDepthFrames += mNumUSBFramesPerList;
+
+	if (framesQueued < kQueueDepthGuardFrames)
+	{
+		// Back off right away, and give the shorter queue a longer look next time.
+		if (mNumUSBFrameListsToQueue < mMaxNumUSBFrameListsToQueue)
+		{
+			numFrameListsToQueue = 2;
+		}
+		if (mQueueDepthHoldoff < kQueueDepthMaxHoldoff)
+		{
+			mQueueDepthHoldoff *= 2;
+		}
+	}
+	else if (mQueueDepthFrames >= kQueueDepthShrinkInterval * mQueueDepthHoldoff)
+	{
+		// Only shorten the queue if the completions would still have kept their guard with one frame list less.
+		if	(		(mNumUSBFrameListsToQueue > kMinimumFrameListsToQueue)
+				&&	(mQueueDepthMinMargin >= (SInt32)mNumUSBFramesPerList + kQueueDepthGuardFrames))
+		{
+			numFrameListsToQueue = 0;
+		}
+	}
+	else
+	{
+		goto Exit;
+	}
+
+	if (1 != numFrameListsToQueue)
+	{
+		// How much later than their frame lists the completions ran, the worst case at the depth that is being left.
+		lateness = (SInt32)(mNumUSBFramesPerList * (mNumUSBFrameListsToQueue - 1)) - mQueueDepthMinMargin;
+		mCompletionLateness = (lateness > 0) ? lateness : 0;
+		mNumUSBFrameListsToQueue = mNumUSBFrameListsToQueue + numFrameListsToQueue - 1;
+		mQueueDepthChanged = true;
+		#if DEBUGLOADING
+		debugIOLog ("? DJM03AudioStream[%p]::adaptQueueDepth () - %lu frame lists queued, %ld frames of margin, completions up to %lu frames late", this, mNumUSBFrameListsToQueue, mQueueDepthMinMargin, mCompletionLateness);
+		#endif
+	}
+	mQueueDepthFrames = 0;
+	mQueueDepthMinMargin = 0x7FFFFFFF;
+
+Exit:
+	return numFrameListsToQueue;
+}
+#endif
+
+#pragma mark -Isoc Fault Simulation-
+
+#if SIMULATEISOCFAULTS
+// Steps one of the stream's fault generators. Both start from kSimulatedFaultSeed when the stream starts, so a run
+// injects the same faults into the same packets every time.
+UInt32 DJM03AudioStream::nextSimulatedFault (UInt32 * state) {
+	*state = (*state * 1664525) + 1013904223;
+	return *state >> 8;
+}
+
+// Rewrites a completed input frame list the way a misbehaving device or host controller would have returned it.
+void DJM03AudioStream::simulateIsocFaults (IOUSBLowLatencyIsocFrame * pFrames, UInt32 numFrames) {
+	UInt32							frameIndex;
+	UInt32							numBytesToDrop;
+
+	for (frameIndex = 0; frameIndex < numFrames && pFrames; frameIndex++)
+	{
+		if (kIOReturnSuccess != pFrames[frameIndex].frStatus)
+		{
+			continue;
+		}
+		if ((0 != kSimulatedOverrunRate) && (0 == nextSimulatedFault (&mSimulatedFaultState) % kSimulatedOverrunRate))
+		{
+			// <rdar://6902105> Some host controllers report an overrun with nothing received.
+			pFrames[frameIndex].frStatus = kIOReturnOverrun;
+			pFrames[frameIndex].frActCount = 0;
+		}
+		else if ((0 != kSimulatedUnderrunRate) && (0 == nextSimulatedFault (&mSimulatedFaultState) % kSimulatedUnderrunRate))
+		{
+			pFrames[frameIndex].frStatus = kIOReturnUnderrun;
+		}
+		else if ((0 != kSimulatedShortPacketRate) && (0 == nextSimulatedFault (&mSimulatedFaultState) % kSimulatedShortPacketRate))
+		{
+			// Drop between one sample frame and half the packet.
+			numBytesToDrop = mBytesPerSampleFrame * (1 + nextSimulatedFault (&mSimulatedFaultState) % (mAverageFrameSize / (2 * mBytesPerSampleFrame) + 1));
+			pFrames[frameIndex].frActCount = (pFrames[frameIndex].frActCount > numBytesToDrop) ? pFrames[frameIndex].frActCount - numBytesToDrop : 0;
+			pFrames[frameIndex].frStatus = kIOReturnUnderrun;
+		}
+	}
+}
+
+// Now and then holds the calling thread up, as a host busy with something else would.
+void DJM03AudioStream::simulateHostJitter (UInt32 * state) {
+	if ((0 != kSimulatedJitterRate) && (0 == nextSimulatedFault (state) % kSimulatedJitterRate))
+	{
+		IODelay (nextSimulatedFault (state) % (kSimulatedMaxJitter + 1));
+	}
+}
+#endif
+
+#if LOGISOCSTATISTICS
+// Adds the time since startTime and numUSBFrames of audio to the statistics. Once they cover a second of audio they are
+// logged and cleared, which only the completions do. convertInputSamples () passes 0 frames.
+void DJM03AudioStream::updateIsocStatistics (UInt64 startTime, UInt32 numUSBFrames) {
+	UInt64							endTime;
+	UInt64							nanos;
+
+	clock_get_uptime (&endTime);
+	OSAddAtomic64 ((SInt64)(endTime - startTime), &mIsocStatistics.processingTime);
+	mIsocStatistics.usbFrames += numUSBFrames;
+	if ((0 != numUSBFrames) && (mIsocStatistics.usbFrames >= 1000))
+	{
+		absolutetime_to_nanoseconds (mIsocStatistics.processingTime, &nanos);
+		debugIOLog ("? DJM03AudioStream[%p]::updateIsocStatistics () - %s, %lu ms of audio: %llu us of CPU, %lu short packets, %lu error packets, %ld shortfalls, %lu overruns and %lu concealed packets so far",
+					this, (kUSBIn == mDirection) ? "in" : "out", mIsocStatistics.usbFrames, nanos / 1000, mIsocStatistics.shortPackets, mIsocStatistics.errorPackets, mIsocStatistics.shortfalls, mOverrunsCount, mConcealedPackets);
+		bzero (&mIsocStatistics, sizeof (mIsocStatistics));
+	}
+}
+#endif
+
 #pragma mark -USB Audio Plugin-
 
 void DJM03AudioStream::registerPlugin (DJM03AudioPlugin * thePlugin) {
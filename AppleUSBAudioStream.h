@@ -82,19 +82,33 @@ class DJM03AudioDevice;
 
 #define kMinimumFrameOffset				6
 
-#define RECORD_NUM_USB_FRAME_LISTS				32		//8,128
-#define RECORD_NUM_USB_FRAMES_PER_LIST			2
-#define RECORD_NUM_USB_FRAME_LISTS_TO_QUEUE		16		//4,64
+// Latency profiles pick the frame list geometry of a stream, see kLatencyProfiles in DJM03AudioStream.cpp.
+enum
+{
+	kLatencyProfileUltraLow				= 0,
+	kLatencyProfileBalanced,							// the geometry the driver has always used
+	kLatencyProfileSafe,
+	kLatencyProfileCount
+};
 
-#define PLAY_NUM_USB_FRAME_LISTS				4
-#define PLAY_NUM_USB_FRAMES_PER_LIST			8		//8,64
-#define PLAY_NUM_USB_FRAME_LISTS_TO_QUEUE		2
-#define	PLAY_NUM_USB_FRAMES_PER_LIST_SYNC		4		//4,32
+// Every profile queues half of its frame lists, which checkForFeedbackEndpoint () counts on when it shortens the output
+// frame lists.
+typedef struct _LatencyProfile {
+	UInt32	recordNumUSBFrameLists;
+	UInt32	recordNumUSBFramesPerList;
+	UInt32	recordNumUSBFrameListsToQueue;
+	UInt32	playNumUSBFrameLists;
+	UInt32	playNumUSBFramesPerList;
+	UInt32	playNumUSBFrameListsToQueue;
+	UInt32	playNumUSBFramesPerListSync;		// if the feedback endpoint has to be read more often than that
+	UInt32	extraSafetyOffset;					// in ms, on top of the sample offsets updateSampleOffsetAndLatency () works out
+} LatencyProfile;
 
 // [rdar://5623096] Make note of the slowest polling interval in ms for feedback endpoints
 
 #define kMaxFeedbackPollingInterval				512
 #define kSampleFractionAccumulatorRollover		65536 * 1000
+#define kMaxPacketCadenceLength					1024			// transactions; a longer cycle is left to the accumulator
 
 #define kMaxFilterSize							33				// <rdar://problem/7378275>
 #define kFilterScale							1024			// <rdar://problem/7378275>
@@ -105,9 +119,49 @@ typedef struct _IOAudioSamplesPerFrame {
     UInt32	fraction;		// This fraction is stored x 1000 to preserve precision
 } IOAudioSamplesPerFrame;
 
+// Counted for LOGISOCSTATISTICS, and logged and cleared after every second of audio
+typedef struct _IsocStatistics {
+	volatile SInt64	processingTime;		// in the completions and in convertInputSamples (), absolute time
+	UInt32			usbFrames;			// of audio the completions have moved
+	UInt32			shortPackets;		// under mAverageFrameSize - 2 samples
+	UInt32			errorPackets;		// with a status other than success or underrun
+	volatile SInt32	shortfalls;			// CoalesceInputSamples () calls on the CoreAudio thread that ran out of packets
+} IsocStatistics;
+
 // <rdar://6411577> Overruns threshold in packets (about 2ms at 48kHz, close to the safety offset value)
 #define kOverrunsThreshold						100
 
+// Times CoalesceInputSamples () on the CoreAudio thread waits 1 us for, or starts over after, the readHandler
+#define kMaxCoalescenceAttempts					100
+
+// Words in each of the two fake frame lists stressCoalescenceHandoff () copies from
+#define kStressFrameListWords					256
+
+// Completion parameter queueInputFrames () passes to readHandler (); a USB completion passes its frame list index
+#define kQueuedInputFrameListParameter			((void *)-1)
+
+// Longest gap, in sample frames, ConcealInputPacket () bridges with a straight line when it has the next packet
+#define kConcealInterpolateFrames				8
+
+// Most packets CoalesceInputSamples () gathers with a single CopyInputRun ()
+#define kMaxInputRunFrames						16
+
+// Stream property (OSNumber, one of the kClipDither* modes) that selects the dither applied when clipping output
+#define kDitherModeKey							"DJM03AudioDitherMode"
+
+// Stream property (OSArray of OSNumbers, one per channel of the stream) that routes channels during the sample conversion.
+// Entry n is the channel feeding channel n of the destination; anything past the last channel silences it. An empty
+// array removes the routing.
+#define kChannelMapKey							"DJM03AudioChannelMap"
+
+// Stream property (OSBoolean) that turns on the level meters read with getMeterSnapshot ()
+#define kMeteringKey							"DJM03AudioMetering"
+
+// Stream property (OSNumber, one of the kLatencyProfile* values) that selects the frame list geometry. It can only be
+// changed while the stream is stopped. The same key on the stream interface, e.g. from a vendor kext, sets the profile
+// the stream starts out with.
+#define kLatencyProfileKey						"DJM03AudioLatencyProfile"
+
 class DJM03AudioEngine;
 class DJM03AudioPlugin;
 
@@ -127,6 +181,8 @@ public:
     virtual bool terminate (IOOptionBits options = 0);
 	virtual	bool matchPropertyTable(OSDictionary * table, SInt32 *score);
     virtual void registerService(IOOptionBits options = 0);			// <rdar://7295322>
+	virtual IOReturn setProperties (OSObject * properties);
+	IOReturn getMeterSnapshot (ClipMeterState * snapshot, bool reset = false);
 
     virtual IOReturn setFormat(const IOAudioStreamFormat *streamFormat, bool callDriver = true);																					// <rdar://7259238>
     virtual IOReturn setFormat(const IOAudioStreamFormat *streamFormat, const IOAudioStreamFormatExtension *formatExtension, OSDictionary *formatDict, bool callDriver = true);		// <rdar://7259238>
@@ -171,7 +227,8 @@ protected:
 #endif
 
 	bool								mSplitTransactions;
-	IORecursiveLock *					mCoalescenceMutex;						// <rdar://problem/7378275>
+	volatile UInt32						mCoalescenceSequence;					// odd while the readHandler coalesces, see CoalesceInputSamples ()
+	IOSimpleLock *						mCoalescenceCopyLock;					// held across a checked copy on the CoreAudio thread
 	
 	IOUSBLowLatencyIsocFrame *			mUSBIsocFrames;
 	IOUSBIsocFrame						mSampleRateFrame;
@@ -217,17 +274,23 @@ protected:
 	UInt32								mSafeErasePoint;
 	UInt32								mLastSafeErasePoint;
 	UInt32								mReadUSBFrameListSize;
-	UInt32								mBufferOffset;
+	volatile UInt32						mBufferOffset;
 	
 	IOAudioSamplesPerFrame				mSamplesPerPacket;				// store this as a 16.16 value <rdar://problem/6954295>
 	
 	UInt32								mNumUSBFrameLists;
 	UInt32								mNumUSBFramesPerList;
 	UInt32								mNumTransactionsPerList;
-	UInt32								mNumUSBFrameListsToQueue;
+	UInt32								mNumUSBFrameListsToQueue;			// how many are queued right now
+	UInt32								mMaxNumUSBFrameListsToQueue;		// from the latency profile
 	UInt32								mSampleBufferSize;
 	UInt32								mBytesPerSampleFrame;
 	UInt32								mFractionalSamplesLeft;
+	UInt16								mPacketCadence[kMaxPacketCadenceLength];	// samples per transaction, one cycle
+	UInt32								mPacketCadenceLength;				// 0 if the cycle is too long for the table
+	UInt32								mPacketCadenceIndex;
+	UInt32								mPacketCadenceStartFraction;		// mFractionalSamplesLeft at index 0
+	IOAudioSamplesPerFrame				mPacketCadenceSamplesPerPacket;		// what the table was built for
 	#if DEBUGLATENCY
 		UInt32								mLastFrameListSize;
 		UInt32								mThisFrameListSize;
@@ -235,14 +298,26 @@ protected:
 	UInt16								mSampleSize;
 	UInt16								mSampleBitWidth;
 	UInt32								mNumChannels;
+	bool								mFloatFormat;
+	ClipDitherState						mDitherState;
+	UInt8								mChannelMap[kClipMaxRoutedChannels];
+	volatile bool						mChannelMapActive;					// false for no map or an identity map
+	bool								mMeteringEnabled;
+	ClipMeterState						mMeterState;
 	UInt16								mFramesUntilRefresh;
 	UInt8								mInterfaceNumber;
 	UInt8								mAlternateSettingID;
 	UInt8								mRefreshInterval;
 	UInt8								mFeedbackPacketSize;
+	#if FEEDBACKPLL
+	UInt64								mFeedbackRate;				// samples per packet x kSampleFractionAccumulatorRollover
+	SInt64								mFeedbackPhaseError;		// the same x USB frames, asked for by the device and not sent
+	UInt32								mFeedbackFrames;			// USB frames between the last two feedback reads
+	bool								mFeedbackLocked;
+	#endif
 	UInt8								mDirection;
 	UInt8								mTransactionsPerUSBFrame;
-	Boolean								mInCompletion;
+	volatile UInt32						mInCompletion;
 	Boolean								mUSBStreamRunning;
 	Boolean								mTerminatingDriver;
 	Boolean								mUHCISupport;
@@ -254,6 +329,23 @@ protected:
 	bool								mGeneratesOverruns;
 	UInt32								mOverrunsCount;			// <rdar://6902105>
 	UInt32								mOverrunsThreshold;		// <rdar://6411577>
+	UInt32								mLatencyProfile;
+	UInt32								mConsecutiveOverruns;	// since the last good packet
+	UInt32								mConcealedPackets;
+	#if SIMULATEISOCFAULTS
+	UInt32								mSimulatedFaultState;		// completions only
+	UInt32								mSimulatedJitterState;		// CoreAudio thread only
+	#endif
+	#if LOGISOCSTATISTICS
+	IsocStatistics						mIsocStatistics;
+	#endif
+	#if ADAPTIVEQUEUEDEPTH
+	UInt32								mQueueDepthFrames;			// USB frames completed at the current queue depth
+	UInt32								mQueueDepthHoldoff;			// in kQueueDepthShrinkInterval units
+	SInt32								mQueueDepthMinMargin;		// in USB frames, at the current queue depth
+	volatile UInt32						mCompletionLateness;		// in USB frames, for updateSampleOffsetAndLatency ()
+	volatile bool						mQueueDepthChanged;
+	#endif
 		
 	UInt64								mNumSampleRateFeedbackChangesCounter;
 	UInt64								mNumSampleRateFeedbackEqualCounter;
@@ -290,11 +382,22 @@ protected:
 	UInt32		getLockDelayFrames (void);
 		
 	void		initializeUSBFrameList ( IOUSBLowLatencyIsocFrame * usbIsocFrames, UInt32 numFrames );	// <rdar://7568547>
+	void		buildPacketCadence (void);
+	#if FEEDBACKPLL
+	void		updateFeedbackPLL (IOAudioSamplesPerFrame requestedSamplesPerFrame);
+	#endif
 
 	void		setMasterStreamMode ( bool masterMode ) { mMasterMode = masterMode; }
 	void		compensateForSynchronization ( bool syncCompensation ) { mSyncCompensation = syncCompensation; }
 
 	IOReturn	GetDefaultSettings (UInt8 * altSettingID, IOAudioSampleRate * sampleRate);	// added for rdar://3866513 
+	IOReturn	setDitherMode (UInt32 ditherMode);
+	IOReturn	setChannelMap (OSArray * channelMap);
+	IOReturn	setLatencyProfile (UInt32 latencyProfile);
+	static IOReturn	latencyProfileAction (OSObject * owner, void * stream, void * latencyProfile, void * arg3, void * arg4);
+	IOReturn	protectedSetLatencyProfile (UInt32 latencyProfile);
+	void		applyLatencyProfile (void);
+	IOReturn	setMetering (bool enable);
 
 	virtual bool willTerminate (IOService * provider, IOOptionBits options);
 
@@ -307,7 +410,37 @@ protected:
 
     virtual UInt32 getCurrentSampleFrame (void);
 
+	bool isInputPacketToConceal (IOUSBLowLatencyIsocFrame * frame);
+	void ConcealInputPacket (IOUSBLowLatencyIsocFrame * pFrames, UInt32 usbFrameIndex, UInt32 firstUSBFrameIndex, UInt8 * packet, UInt32 bufferOffset);
+	UInt8 * getConcealmentHistory (UInt8 * packet, UInt32 numBytesPresent, UInt32 bufferOffset, UInt32 numFramesBack);
+	SInt64 getConcealmentSample (UInt8 * sample, UInt32 subframeSize);
+	void setConcealmentSample (UInt8 * sample, UInt32 subframeSize, SInt64 value);
+	void CopyInputRun (UInt8 * dest, UInt8 * source, IOUSBLowLatencyIsocFrame * pFrames, UInt16 * byteCounts, UInt32 numFrames);
 	virtual IOReturn CoalesceInputSamples (UInt32 numBytesToCoalesce, IOUSBLowLatencyIsocFrame * pFrames);
+	bool getCoalescencePosition (UInt32 * sequence, UInt32 * frameList, UInt32 * bufferOffset);
+	bool isCoalescencePositionCurrent (UInt32 sequence);
+	void beginCoalescence (void);
+	void endCoalescence (void);
+	bool lockCoalescencePosition (UInt32 sequence);
+	void unlockCoalescencePosition (void);
+	#if STRESSCOALESCENCEHANDOFF
+	void stressCoalescenceHandoff (void);
+	static void stressCoalescenceProducer (thread_call_param_t param, thread_call_param_t unused);
+	#endif
+	#if SIMULATEISOCFAULTS
+	UInt32 nextSimulatedFault (UInt32 * state);
+	void simulateIsocFaults (IOUSBLowLatencyIsocFrame * pFrames, UInt32 numFrames);
+	void simulateHostJitter (UInt32 * state);
+	#endif
+	#if LOGISOCSTATISTICS
+	void updateIsocStatistics (UInt64 startTime, UInt32 numUSBFrames);
+	#endif
+	#if ADAPTIVEQUEUEDEPTH
+	UInt32 adaptQueueDepth (SInt64 framesQueued);
+	#endif
+	#if DIRECTINPUTCONVERT
+	IOReturn ConvertInputSamplesFromFrameLists (UInt32 bufferOffset, UInt32 numBytesToConvert, void * destBuf, const IOAudioStreamFormat * streamFormat);
+	#endif
 	
 	virtual	IOReturn controlledFormatChange (const IOAudioStreamFormat *newFormat, const IOAudioSampleRate *newSampleRate);
 	void calculateSamplesPerPacket (UInt32 sampleRate, UInt16 * averageFrameSize, UInt16 * additionalSampleFrameFreq);